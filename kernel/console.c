@@ -47,14 +47,16 @@ void console_put(int c)
  */
 static int console_write(unsigned long src, int n)
 {
-  char c;
-  int i;
+  char buf[64];
+  int i, j, m;
 
-  for (i = 0; i < n; i++) {
-    if (copy_from_user(myproc()->pagetable, &c, src + i, sizeof(char)))
+  for (i = 0; i < n; i += m) {
+    m = n - i < sizeof(buf) ? n - i : sizeof(buf);
+    if (copy_from_user(myproc()->pagetable, buf, src + i, m))
       break;
 
-    uart_put(c);
+    for (j = 0; j < m; j++)
+      uart_put(buf[j]);
   }
 
   return i;
@@ -63,16 +65,19 @@ static int console_write(unsigned long src, int n)
 /*
  * For read() system calls.
  * Copy characters out of console.buf until we reach '\n'
+ * Characters are staged in a small buffer so that user memory is only
+ * touched once console.lock is released.
  * Returns number of bytes read, or -1 on error.
  */
 static int console_read(unsigned long dst, int n)
 {
   unsigned int target = n;
-  int c;
+  char buf[64];
+  int c = 0, i;
 
-  acquire(&console.lock);
+  while (n > 0 && c != '\n') {
+    acquire(&console.lock);
 
-  while (n > 0) {
     /* Wait until interrupt handler has put some input into console buffer. */
     while (console.read_index == console.write_index) {
       if (killed(myproc())) {
@@ -83,19 +88,20 @@ static int console_read(unsigned long dst, int n)
       sleep(&console.read_index, &console.lock);
     }
 
-    c = console.buf[console.read_index++ % INPUT_BUF_SIZE];
-
-    if (copy_to_user(myproc()->pagetable, dst, (void *)&c, 1) == -1)
-      break;
+    for (i = 0; i < n && i < sizeof(buf) && c != '\n' &&
+         console.read_index != console.write_index; i++) {
+      c = console.buf[console.read_index++ % INPUT_BUF_SIZE];
+      buf[i] = c;
+    }
 
-    dst++;
-    --n;
+    release(&console.lock);
 
-    if (c == '\n')
+    if (copy_to_user(myproc()->pagetable, dst, buf, i) == -1)
       break;
-  }
 
-  release(&console.lock);
+    dst += i;
+    n -= i;
+  }
 
   return target - n;
 }
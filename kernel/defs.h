@@ -8,7 +8,12 @@ struct spinlock;
 struct sleeplock;
 struct status;
 struct superblock;
+struct vma;
 struct pstat;
+struct memstat;
+struct kmem_cache;
+struct shm;
+struct uffd;
 
 // bio.c
 void            bufcache_init();
@@ -35,6 +40,15 @@ int             fileread(struct file*, unsigned long, int n);
 int             file_status(struct file*, unsigned long addr);
 int             filewrite(struct file*, unsigned long, int n);
 
+// fdt.c
+extern unsigned long phystop;
+extern int      ncpu;
+extern int      nnode;
+extern unsigned long boot_fdt;
+void            fdt_init(unsigned long);
+int             fdt_memory(int, unsigned long *, unsigned long *, int *);
+int             fdt_cpunode(int);
+
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, unsigned int);
@@ -54,6 +68,7 @@ int             readi(struct inode*, int, unsigned long, unsigned int, unsigned
 void            stati(struct inode*, struct status*);
 int             writei(struct inode*, bool, unsigned long, unsigned int, unsigned int);
 void            itrunc(struct inode*);
+int             itext_reclaim();
 
 // ramdisk.c
 void            ramdiskinit();
@@ -63,7 +78,25 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc();
 void            kfree(void *);
+void*           kalloc_nozero();
+int             kalloc_idle();
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            kalloc_split(void *, int);
 void            kalloc_init();
+void            kalloc_stats(struct memstat *);
+void            kpage_ref(void *);
+int             kpage_refcount(void *);
+int             kpage_node(void *);
+
+// slab.c
+void            slab_init();
+struct kmem_cache* kmem_cache_create(char *, int);
+void*           kmem_cache_alloc(struct kmem_cache *);
+void            kmem_cache_free(struct kmem_cache *, void *);
+void*           kmalloc(int);
+void            kmfree(void *);
+void            slab_stats(struct memstat *);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -72,6 +105,7 @@ void            begin_op();
 void            end_op();
 
 // pipe.c
+void            pipe_init();
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, unsigned long, int);
@@ -87,9 +121,8 @@ int             cpuid();
 void            exit(int);
 int             fork();
 int             growproc(int);
-void            proc_mapstacks(unsigned long *);
 unsigned long *     proc_pagetable(struct proc *);
-void            proc_freepagetable(unsigned long *, unsigned long);
+void            proc_freepagetable(unsigned long *);
 int             kill(int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
@@ -100,14 +133,32 @@ void            proc_init();
 void            scheduler() __attribute__((noreturn));
 void            sched();
 void            sleep(void*, struct spinlock*);
-void            userinit();
+void            user_init();
 int             wait(unsigned long);
 void            wakeup(void*);
 void            yield();
 int             either_copyout(bool user_dst, unsigned long dst, void *src, unsigned long len);
 int             either_copyin(void *dst, bool user_src, unsigned long src, unsigned long len);
 void            procdump();
-void            procinfo(struct pstat *);
+int             procinfo(unsigned long);
+void*           proc_evict(int);
+
+// shm.c
+void            shm_init();
+int             shm_get(int, unsigned long);
+struct shm*     shm_attach(int, unsigned long *);
+void            shm_dup(struct shm *);
+void            shm_put(struct shm *);
+int             shm_remove(int);
+void*           shm_page(struct shm *, int);
+
+// swap.c
+void            swap_init(struct superblock *);
+void            swap_dup(int);
+void            swap_free(int);
+void            swap_in(int, void *);
+int             swap_out();
+void            swap_stats(struct memstat *);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -126,6 +177,9 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*);
 
+// start.c
+extern int      zicboz;
+
 // string.c
 int             memcmp(const void*, const void*, unsigned int);
 void*           memmove(void*, const void*, unsigned int);
@@ -134,6 +188,7 @@ char*           safestrcpy(char*, const char*, int);
 int             strlen(const char*);
 int             strncmp(const char*, const char*, unsigned int);
 char*           strncpy(char*, const char*, int);
+void            string_init();
 
 // syscall.c
 void            argint(int, int*);
@@ -146,6 +201,7 @@ void            syscall();
 // trap.c
 extern unsigned int     ticks;
 extern unsigned int     readcount;
+extern int      vstate_order;
 void            trap_init();
 void            trap_init_hart();
 extern struct spinlock tickslock;
@@ -167,14 +223,57 @@ void            uvm_first(unsigned long *, unsigned char *, unsigned int);
 unsigned long          uvm_alloc(unsigned long *, unsigned long, unsigned long, int);
 unsigned long          uvm_dealloc(unsigned long *, unsigned long, unsigned long);
 int             uvm_copy(unsigned long *, unsigned long *, unsigned long);
-void            uvm_free(unsigned long *, unsigned long);
+int             uvm_share(unsigned long *, unsigned long *, unsigned long, unsigned long, bool);
+int             uvm_fault(struct proc *, unsigned long, bool);
+unsigned long   uvm_satp(struct proc *);
+unsigned long   kvm_stack_alloc(unsigned long);
+void            kvm_stack_free(unsigned long);
+void            kvm_sync();
+void            uvm_free(unsigned long *);
 void            uvm_unmap(unsigned long *, unsigned long, unsigned long, int);
 void            uvm_clear(unsigned long *, unsigned long);
+void*           uvm_page(bool);
+int             uvm_mappage(unsigned long *, unsigned long, unsigned long, int);
+int             uvm_mapzero(unsigned long *, unsigned long, int);
+void            uvm_stats(struct memstat *);
+void*           uvm_evict(struct proc *, int);
+void            uvm_numa(struct proc *);
+void            uvm_protect(unsigned long *, unsigned long, unsigned long, bool);
+void            uvm_prefault(unsigned long, unsigned long, bool);
+void            uvm_window(unsigned long *);
+int             uvm_window_fault(unsigned long, bool);
+unsigned long*  walk(unsigned long *, unsigned long, int);
 unsigned long          walkaddr(unsigned long *, unsigned long);
 int             copy_to_user(unsigned long *, unsigned long, char *, unsigned long);
 int             copy_from_user(unsigned long *, char *, unsigned long, unsigned long);
 int             copyin_str(unsigned long *, char *, unsigned long, unsigned long);
 
+// uffd.c
+struct file*    uffd_alloc();
+void            uffd_dup(struct uffd *);
+void            uffd_put(struct uffd *);
+void            uffd_close(struct uffd *);
+int             uffd_register(struct uffd *, unsigned long, unsigned long, int);
+int             uffd_fault(struct proc *, struct vma *, unsigned long, int);
+int             uffd_read(struct uffd *, unsigned long, int);
+int             uffd_copy(struct uffd *, unsigned long, unsigned long, unsigned long);
+int             uffd_zero(struct uffd *, unsigned long, unsigned long);
+int             uffd_wp(struct uffd *, unsigned long, unsigned long, int);
+
+// vma.c
+struct vma*     vma_find(struct proc *, unsigned long);
+int             vma_fault(struct proc *, struct vma *, unsigned long, bool);
+struct vma*     vma_overlap(struct proc *, unsigned long, unsigned long);
+int             vma_copy(struct proc *, struct proc *);
+void            vma_release(struct vma *);
+unsigned long   vma_map(struct proc *, struct inode *, unsigned long, unsigned long, unsigned long, int, int);
+int             vma_unmap(struct proc *, unsigned long, unsigned long);
+void            vma_text_drop(struct inode *);
+void            vma_text_write(struct inode *, unsigned int, char *, unsigned int);
+int             vma_text_reclaim(struct inode *);
+void            vma_init();
+unsigned long   vma_shm(struct proc *, struct shm *, unsigned long, unsigned long);
+
 // plic.c
 void            plic_init();
 void            plic_init_hart();
@@ -184,6 +283,7 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init();
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rw_page(unsigned int, void *, int);
 void            virtio_disk_intr();
 
 // number of elements in fixed-size array
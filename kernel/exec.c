@@ -6,8 +6,6 @@
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(unsigned long *, unsigned long, struct inode *, unsigned int, unsigned int);
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -24,12 +22,15 @@ exec(char *path, char **argv)
   char *s, *last;
   int i, off;
   unsigned long argc, sz = 0, sp, ustack[MAXARG], stackbase;
+  struct vma vma[NVMA], *v = vma;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
   unsigned long * pagetable = 0, *oldpagetable;
   struct proc *p = myproc();
 
+  memset(vma, 0, sizeof(vma));
+
   begin_op();
 
   if ((ip = namei(path)) == 0) {
@@ -48,7 +49,8 @@ exec(char *path, char **argv)
   if ((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments; vma_fault() reads their pages in
+  // from the file on first touch.
   for (i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)) {
     if (readi(ip, 0, (unsigned long)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -58,31 +60,39 @@ exec(char *path, char **argv)
       goto bad;
     if (ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if (ph.vaddr % PGSIZE != 0)
+    if (ph.vaddr % PGSIZE != 0 || ph.vaddr < sz)
       goto bad;
-    unsigned long sz1;
-    if ((sz1 = uvm_alloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
-      goto bad;
-    sz = sz1;
-    if (loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if (ph.vaddr + ph.memsz >= TRAPFRAME || v == &vma[NVMA])
       goto bad;
+    v->type = VMA_EXEC;
+    v->start = ph.vaddr;
+    v->end = ph.vaddr + ph.memsz;
+    v->perm = PTE_R | flags2perm(ph.flags);
+    v->ip = idup(ip);
+    v->off = ph.off;
+    v->filesz = ph.filesz;
+    v++;
+    sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
   ip = 0;
 
   p = myproc();
-  unsigned long oldsz = p->sz;
 
-  // Allocate two pages at the next page boundary.
-  // Make the first inaccessible as a stack guard.
-  // Use the second as the user stack.
+  // Reserve a guard page and USERSTACK pages of stack at the next
+  // page boundary. Make the guard inaccessible, and allocate only the
+  // top stack page, for the arguments; the stack lies below p->sz, so
+  // uvm_fault() fills in the rest as it grows down. The page tables
+  // of the guard and the top page keep megapages out of a stack of at
+  // most 2M.
   sz = PGROUNDUP(sz);
-  unsigned long sz1;
-  if ((sz1 = uvm_alloc(pagetable, sz, sz + 2*PGSIZE, PTE_W)) == 0)
+  if (uvm_alloc(pagetable, sz, sz + PGSIZE, 0) == 0)
+    goto bad;
+  uvm_clear(pagetable, sz);
+  sz += (1 + USERSTACK) * PGSIZE;
+  if (uvm_alloc(pagetable, sz - PGSIZE, sz, PTE_W) == 0)
     goto bad;
-  sz = sz1;
-  uvm_clear(pagetable, sz-2*PGSIZE);
   sp = sz;
   stackbase = sp - PGSIZE;
 
@@ -120,46 +130,36 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vma_unmap(p, 0, MAXVA); // write back and drop the old image's mmap() regions
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  p->tlbdirty = 1;  // the old image's entries are still tagged with p's ASID
+#ifdef SUM
+  uvm_window(pagetable);  // before the old page-table pages are freed
+#endif
   p->sz = sz;
+  p->hugepages = 0;
+  p->numava = 0;  // the old image's pages no longer count
+  memset(p->numapages, 0, sizeof(p->numapages));
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
+  proc_freepagetable(oldpagetable);
+
+  begin_op();
+  vma_release(p->vma);
+  end_op();
+  memmove(p->vma, vma, sizeof(vma));
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   if (pagetable)
-    proc_freepagetable(pagetable, sz);
-  if (ip) {
+    proc_freepagetable(pagetable);
+  if (!ip)
+    begin_op();
+  vma_release(vma);
+  if (ip)
     iunlockput(ip);
-    end_op();
-  }
+  end_op();
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(unsigned long * pagetable, unsigned long va, struct inode *ip, unsigned int offset, unsigned int sz)
-{
-  unsigned int i, n;
-  unsigned long pa;
-
-  for (i = 0; i < sz; i += PGSIZE) {
-    pa = walkaddr(pagetable, va + i);
-    if (pa == 0)
-      panic("loadseg: address should exist");
-    if (sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if (readi(ip, 0, (unsigned long)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
@@ -3,3 +3,12 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+
+// mmap() protection and flags
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+#define PROT_EXEC   0x4
+#define MAP_SHARED  0x01  // stores reach the file
+#define MAP_PRIVATE 0x02  // stores stay in this process
+#define MAP_ANONYMOUS 0x20 // zeroed memory, no file
+#define MAP_FAILED  ((void *) -1)
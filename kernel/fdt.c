@@ -0,0 +1,224 @@
+/* Flattened device tree parsing, just enough to size the machine: the
+ * RAM regions, the number of harts, and the NUMA node of each (the
+ * numa-node-id property, node 0 if there is none). QEMU passes the tree's physical
+ * address in a1 at boot, and start() saves it for fdt_init().
+ *
+ * A tree is a header, a block of tokens that describe the nodes and
+ * their properties, and a block of property names. Every integer is
+ * big endian. See the Devicetree Specification, chapter 5.
+ */
+
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+#define FDT_END        9
+
+#define ALIGN4(n) (((n) + 3) & ~3)
+
+struct fdt_header {
+  unsigned int magic;
+  unsigned int totalsize;
+  unsigned int off_dt_struct;
+  unsigned int off_dt_strings;
+  unsigned int off_mem_rsvmap;
+  unsigned int version;
+  unsigned int last_comp_version;
+  unsigned int boot_cpuid_phys;
+  unsigned int size_dt_strings;
+  unsigned int size_dt_struct;
+};
+
+static struct {
+  unsigned long start;
+  unsigned long end;
+  int node;
+} memregions[NMEMREGION];
+static int nmemregion;
+static int cpunode[NCPU];
+
+unsigned long phystop;  /* End of the highest RAM region the kernel uses */
+int ncpu;               /* Harts in the tree, at most NCPU */
+int nnode;              /* NUMA nodes, at most NNODE */
+
+static unsigned int be32(const void *p)
+{
+  const unsigned char *b = p;
+
+  return (unsigned int)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+/* Read a number n 32-bit cells long, advancing *p past it. */
+static unsigned long cells(const unsigned char **p, int n)
+{
+  unsigned long v = 0;
+
+  for (; n > 0; n--, *p += 4)
+    v = v << 32 | be32(*p);
+
+  return v;
+}
+
+/* Add the RAM in [start, end) that the direct map can reach. */
+static void fdt_addmemory(unsigned long start, unsigned long end)
+{
+  if (start < KERNBASE)
+    start = KERNBASE;
+  if (end > PHYSMAX)
+    end = PHYSMAX;
+  if (start >= end || nmemregion == NMEMREGION)
+    return;
+
+  memregions[nmemregion].start = start;
+  memregions[nmemregion].end = end;
+  nmemregion++;
+}
+
+/* A numa-node-id property, or 0 if it names a node we cannot track. */
+static int fdt_node(const unsigned char *v)
+{
+  unsigned int node = be32(v);
+
+  if (node >= NNODE)
+    return 0;
+  if (node >= nnode)
+    nnode = node + 1;
+  return node;
+}
+
+/* Walk the nodes, collecting the reg property of /memory nodes and
+ * counting the /cpus/cpu@N nodes, with the NUMA node of each. A node's
+ * properties may come in any order, so its NUMA node is applied when
+ * the node ends. Stops at the first unknown token.
+ */
+static void fdt_parse(const unsigned char *fdt)
+{
+  const struct fdt_header *h = (const struct fdt_header *)fdt;
+  const unsigned char *p = fdt + be32(&h->off_dt_struct), *v, *end;
+  const char *strings = (const char *)fdt + be32(&h->off_dt_strings), *name;
+  int depth = 0, acells = 2, scells = 2, memory = 0, cpus = 0, cpu = 0;
+  int first = 0, hart = -1, node = 0;
+  unsigned long base, size;
+  unsigned int len;
+
+  for (;;) {
+    switch (be32(p)) {
+    case FDT_BEGIN_NODE:
+      name = (const char *)p + 4;
+      p += 4 + ALIGN4(strlen(name) + 1);
+      if (++depth == 2) {
+        memory = strncmp(name, "memory", 6) == 0;
+        cpus = strncmp(name, "cpus", 5) == 0;
+        first = nmemregion;
+        node = 0;
+      } else if (depth == 3 && cpus && strncmp(name, "cpu@", 4) == 0) {
+        ncpu++;
+        cpu = 1;
+        hart = -1;
+        node = 0;
+      }
+      break;
+
+    case FDT_END_NODE:
+      p += 4;
+      if (depth == 2 && memory) {
+        for (int i = first; i < nmemregion; i++)
+          memregions[i].node = node;
+      } else if (depth == 3 && cpu) {
+        if (hart >= 0 && hart < NCPU)
+          cpunode[hart] = node;
+        cpu = 0;
+      }
+      if (--depth < 2)
+        memory = cpus = 0;
+      break;
+
+    case FDT_PROP:
+      len = be32(p + 4);
+      name = strings + be32(p + 8);
+      v = p + 12;
+      p += 12 + ALIGN4(len);
+      if (depth == 1 && strncmp(name, "#address-cells", 15) == 0) {
+        acells = be32(v);
+      } else if (depth == 1 && strncmp(name, "#size-cells", 12) == 0) {
+        scells = be32(v);
+      } else if (depth == 2 && memory && strncmp(name, "reg", 4) == 0) {
+        for (end = v + len; v + 4 * (acells + scells) <= end; ) {
+          base = cells(&v, acells);
+          size = cells(&v, scells);
+          fdt_addmemory(base, base + size);
+        }
+      } else if (depth == 3 && cpu && strncmp(name, "reg", 4) == 0 && len >= 4) {
+        hart = cells(&v, len / 4 > 2 ? 2 : len / 4);
+      } else if ((memory || cpu) && len == 4 && strncmp(name, "numa-node-id", 13) == 0) {
+        node = fdt_node(v);
+      }
+      break;
+
+    case FDT_NOP:
+      p += 4;
+      break;
+
+    default:
+      return;
+    }
+  }
+}
+
+/* Find the RAM and harts in the device tree at pa. Without a tree,
+ * assume QEMU's defaults: 128M of RAM at KERNBASE, and NCPU harts.
+ * Called on hart 0 before kalloc_init().
+ */
+void fdt_init(unsigned long pa)
+{
+  if (pa && be32(&((struct fdt_header *)pa)->magic) == FDT_MAGIC)
+    fdt_parse((const unsigned char *)pa);
+  else
+    printf("fdt_init: no device tree\n");
+
+  if (nmemregion == 0)
+    fdt_addmemory(KERNBASE, KERNBASE + 128*1024*1024);
+  if (ncpu == 0 || ncpu > NCPU)
+    ncpu = NCPU;
+  if (nnode == 0)
+    nnode = 1;
+
+  for (int i = 0; i < nmemregion; i++)
+    if (memregions[i].end > phystop)
+      phystop = memregions[i].end;
+
+#ifdef BOOTSTATS
+  unsigned long total = 0;
+
+  for (int i = 0; i < nmemregion; i++)
+    total += memregions[i].end - memregions[i].start;
+  printf("fdt_init: %d harts, %dM of RAM in %d regions up to %p, %d nodes\n",
+         ncpu, (int)(total >> 20), nmemregion, phystop, nnode);
+#endif
+}
+
+/* Set [*start, *end) to RAM region i and *node to its NUMA node.
+ * Returns -1 past the last region.
+ */
+int fdt_memory(int i, unsigned long *start, unsigned long *end, int *node)
+{
+  if (i >= nmemregion)
+    return -1;
+
+  *start = memregions[i].start;
+  *end = memregions[i].end;
+  *node = memregions[i].node;
+  return 0;
+}
+
+/* The NUMA node of hart. */
+int fdt_cpunode(int hart)
+{
+  return hart >= 0 && hart < NCPU ? cpunode[hart] : 0;
+}
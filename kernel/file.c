@@ -9,9 +9,13 @@
 #include "stat.h"
 #include "proc.h"
 
+/* Open files come from an object cache; the table only keeps the
+ * count, so that at most NFILE are open at once.
+ */
 struct file_table {
   struct spinlock lock;
-  struct file file[NFILE];
+  int nfile;
+  struct kmem_cache *cache;
 };
 
 struct file_table ftable;
@@ -20,6 +24,7 @@ struct devsw devsw[NDEV];
 void file_init()
 {
   initlock(&ftable.lock);
+  ftable.cache = kmem_cache_create("file", sizeof(struct file));
 }
 
 struct file *file_alloc()
@@ -27,18 +32,22 @@ struct file *file_alloc()
   struct file *f;
 
   acquire(&ftable.lock);
-
-  for (f = ftable.file; f < ftable.file + NFILE; f++) {
-    if (f->ref == 0) {
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if (ftable.nfile == NFILE) {
+    release(&ftable.lock);
+    return 0;
   }
-
+  ftable.nfile++;
   release(&ftable.lock);
 
-  return 0;
+  if (!(f = kmem_cache_alloc(ftable.cache))) {
+    acquire(&ftable.lock);
+    ftable.nfile--;
+    release(&ftable.lock);
+    return 0;
+  }
+  f->ref = 1;
+
+  return f;
 }
 
 /* Increment ref count for file f. */
@@ -63,12 +72,14 @@ void file_close(struct file *f)
   }
 
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
+  ftable.nfile--;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if (ff.type == FD_PIPE) {
     pipeclose(ff.pipe, ff.writable);
+  } else if (ff.type == FD_UFFD) {
+    uffd_close(ff.uffd);
   } else if (ff.type == FD_INODE || ff.type == FD_DEVICE) {
     begin_op();
     iput(ff.ip);
@@ -106,11 +117,14 @@ fileread(struct file *f, unsigned long addr, int n)
 
   if (f->type == FD_PIPE) {
     r = piperead(f->pipe, addr, n);
+  } else if (f->type == FD_UFFD) {
+    r = uffd_read(f->uffd, addr, n);
   } else if (f->type == FD_DEVICE) {
     if (f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
     r = devsw[f->major].read(addr, n);
   } else if (f->type == FD_INODE) {
+    uvm_prefault(addr, n, true);
     ilock(f->ip);
     if ((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
@@ -152,6 +166,7 @@ filewrite(struct file *f, unsigned long addr, int n)
       if (n1 > max)
         n1 = max;
 
+      uvm_prefault(addr + i, n1, false);
       begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
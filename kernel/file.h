@@ -1,5 +1,5 @@
 struct file {
-  enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE } type;
+  enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE, FD_UFFD } type;
   int ref; // reference count
   char readable;
   char writable;
@@ -7,6 +7,7 @@ struct file {
   struct inode *ip;  // FD_INODE and FD_DEVICE
   unsigned int off;          // FD_INODE
   short major;       // FD_DEVICE
+  struct uffd *uffd; // FD_UFFD
 };
 
 #define major(dev)  ((dev) >> 16 & 0xFFFF)
@@ -27,6 +28,7 @@ struct inode {
   short nlink;
   unsigned int size;
   unsigned int addrs[NDIRECT+1];
+  struct textpage *text; // shared read-only pages, see vma.c
 };
 
 // Map major device number to device functions.
@@ -42,6 +42,7 @@ fsinit(int dev) {
   if (sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  swap_init(&sb);
 }
 
 // Zero a block.
@@ -236,6 +237,20 @@ iupdate(struct inode *ip)
   bufcache_release(bp);
 }
 
+// Free the cached text pages of every inode that no process
+// maps any more. Called by uvm_page() when memory runs out.
+// Returns the number of pages freed.
+int
+itext_reclaim()
+{
+  int n = 0;
+
+  for (struct inode *ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++)
+    if (ip->text)
+      n += vma_text_reclaim(ip);
+  return n;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
@@ -247,14 +262,17 @@ iget(unsigned int dev, unsigned int inum)
   acquire(&itable.lock);
 
   // Is the inode already in the table?
+  // An unreferenced entry that still caches text pages is kept
+  // valid, so running the same program again finds its pages.
   empty = 0;
   for (ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++) {
-    if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
+    if ((ip->ref > 0 || ip->text) && ip->dev == dev && ip->inum == inum) {
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if (empty == 0 && ip->ref == 0)    // Remember empty slot.
+    // Remember empty slot, preferably one without cached pages.
+    if (ip->ref == 0 && (empty == 0 || (empty->text && !ip->text)))
       empty = ip;
   }
 
@@ -263,6 +281,7 @@ iget(unsigned int dev, unsigned int inum)
     panic("iget: no inodes");
 
   ip = empty;
+  vma_text_drop(ip);
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
@@ -295,6 +314,8 @@ ilock(struct inode *ip)
     panic("ilock");
 
   acquiresleep(&ip->lock);
+  if (myproc())
+    myproc()->ilocks++;
 
   if (ip->valid == 0) {
     bp = bufcache_read(IBLOCK(ip->inum, sb));
@@ -319,6 +340,8 @@ iunlock(struct inode *ip)
   if (ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
+  if (myproc())
+    myproc()->ilocks--;
   releasesleep(&ip->lock);
 }
 
@@ -343,6 +366,8 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    // nobody maps it any more either.
+    vma_text_drop(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -446,6 +471,8 @@ itrunc(struct inode *ip)
 
   ip->size = 0;
   iupdate(ip);
+  // what processes map of the file reads as zeros now.
+  vma_text_write(ip, 0, 0, MAXFILE*BSIZE);
 }
 
 // Copy stat information from inode.
@@ -469,6 +496,7 @@ readi(struct inode *ip, int user_dst, unsigned long dst, unsigned int off, unsig
 {
   unsigned int tot, m;
   struct buf *bp;
+  int r;
 
   if (off > ip->size || off + n < off)
     return 0;
@@ -481,12 +509,17 @@ readi(struct inode *ip, int user_dst, unsigned long dst, unsigned int off, unsig
       break;
     bp = bufcache_read(addr);
     m = min(n - tot, BSIZE - off%BSIZE);
-    if (either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-      bufcache_release(bp);
+    // copying to user memory may fault in a page of this very block,
+    // so keep the buffer pinned but unlocked during the copy.
+    // ip->lock keeps writers of the block away.
+    bufcache_pin(bp);
+    bufcache_release(bp);
+    r = either_copyout(user_dst, dst, bp->data + (off % BSIZE), m);
+    bufcache_unpin(bp);
+    if (r == -1) {
       tot = -1;
       break;
     }
-    bufcache_release(bp);
   }
   return tot;
 }
@@ -519,6 +552,8 @@ writei(struct inode *ip, bool user_src, unsigned long src, unsigned int off, uns
       bufcache_release(bp);
       break;
     }
+    // processes that map the file see the new bytes.
+    vma_text_write(ip, off, (char*)bp->data + (off % BSIZE), m);
     log_write(bp);
     bufcache_release(bp);
   }
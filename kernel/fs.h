@@ -7,7 +7,8 @@
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+//                                          free bit map | data blocks |
+//                                                         swap area ]
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -20,6 +21,8 @@ struct superblock {
   unsigned int logstart;     // Block number of first log block
   unsigned int inodestart;   // Block number of first inode block
   unsigned int bmapstart;    // Block number of first free map block
+  unsigned int swapstart;    // Block number of first swap block
+  unsigned int nswap;        // Number of swap slots, one page each
 };
 
 #define FSMAGIC 0x10203040
@@ -1,64 +1,632 @@
 /* Physical memory allocator, for user processes, kernel stacks,
- * page-table pages, and pipe buffers. Allocates 4K pages.
+ * page-table pages, and pipe buffers. Allocates 4K pages, or physically
+ * contiguous blocks of 2^order pages with kalloc_pages().
+ *
+ * Free memory is kept by a buddy allocator: one free list per order,
+ * where a block of 2^order pages is aligned (relative to KERNBASE) to its
+ * size. A block is split on allocation and merged with its free buddy
+ * when it is freed.
+ *
+ * Each NUMA node has buddy lists of its own, under its own lock, and a
+ * block never merges with a buddy on another node. Allocations come
+ * from the node of the hart asking, and from the other nodes in turn
+ * only when it has nothing free; pages that end up on another node's
+ * hart are counted as remote.
+ *
+ * Each hart keeps a small cache of free single pages of its own node so
+ * that the common kalloc()/kfree() path does not contend on a node's
+ * lock. Caches are refilled from, and drained to, the buddy lists in
+ * batches; kfree() hands a page of another node straight back. Each
+ * cache also holds a pool of pages that the hart zeroed while it had
+ * nothing to run, so kalloc() usually does not have to zero a page.
+ * kalloc_nozero() is for callers that overwrite the whole page. When
+ * kalloc_pages() finds no block large enough, every hart's cache and
+ * pool go back to the buddy lists first.
+ *
+ * Every allocated block carries a reference count, kept for its first
+ * page, so that pages can be shared copy-on-write; kfree() only frees a
+ * page when the last reference is dropped.
+ *
+ * The allocator manages the RAM regions that fdt_init() found. Its
+ * per-page state covers KERNBASE to phystop and sits in the first pages
+ * after the kernel, since its size is only known at boot.
  */
 
+#include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "memstat.h"
+
+#define KCACHE_BATCH 16                 /* Pages moved per refill/drain */
+#define KCACHE_MAX   (2*KCACHE_BATCH)   /* Drain once a cache holds this many */
+#define KZERO_MAX    32                 /* Pre-zeroed pages kept per hart */
+
+#define PA2IDX(pa) (((unsigned long)(pa) - KERNBASE) / PGSIZE)
+#define IDX2PA(i)  ((struct page *)(KERNBASE + (i) * PGSIZE))
 
 extern char end[]; /* First address after kernel, set by linker */
 
 struct page {
   struct page *next;
+  struct page *prev; /* Only used on the buddy lists */
 };
 
-struct kmem {
+/* Per-hart page cache. The lock is only contended when another hart
+ * steals from this cache because the buddy lists ran dry.
+ */
+struct kmem_cpu {
   struct spinlock lock;
   struct page *freelist;
+  int nfree;
+  struct page *zerolist;  /* Pages zeroed by kalloc_idle() */
+  int nzero;
+  int node;               /* The hart's NUMA node */
+  unsigned long refills;
+  unsigned long drains;
+  unsigned long zerohits;
+} __attribute__((aligned(64)));
+
+/* Free memory of one NUMA node. */
+struct knode {
+  struct spinlock lock;
+  struct page free[MAXORDER+1];     /* Circular buddy lists, one per order */
+  unsigned long nfree[MAXORDER+1];  /* Blocks on each list */
+  unsigned long allocs;             /* Pages taken from the lists */
+  unsigned long remote;             /* Of those, pages for a hart on another node */
+} __attribute__((aligned(64)));
+
+struct kmem {
+  struct knode node[NNODE];
+  struct kmem_cpu cpu[NCPU];
+  unsigned long npages;             /* Pages from KERNBASE to phystop */
+  unsigned char *order;             /* 1 + order of the free block starting here, else 0 */
+  unsigned char *nodeid;            /* NUMA node of each page */
+  int *ref;                         /* Updated atomically */
 };
 
 static struct kmem kmem;
 
+#define PA2NODE(pa) (&kmem.node[kmem.nodeid[PA2IDX(pa)]])
+
+/* Bytes cbo.zero clears, or 0 if the harts do not have Zicboz. */
+static int cbo_blocksize;
+
+/* Put a free block on its buddy list. Called with n->lock held. */
+static void buddy_insert(struct knode *n, struct page *p, int order)
+{
+  struct page *head = &n->free[order];
+
+  p->next = head->next;
+  p->prev = head;
+  head->next->prev = p;
+  head->next = p;
+  kmem.order[PA2IDX(p)] = order + 1;
+  n->nfree[order]++;
+}
+
+/* Take a free block off its buddy list. Called with n->lock held. */
+static void buddy_remove(struct knode *n, struct page *p, int order)
+{
+  p->prev->next = p->next;
+  p->next->prev = p->prev;
+  kmem.order[PA2IDX(p)] = 0;
+  n->nfree[order]--;
+}
+
+/* Returns a block of 2^order pages of node n, splitting a larger block
+ * if need be. Called with n->lock held.
+ */
+static struct page *buddy_alloc(struct knode *n, int order)
+{
+  struct page *p;
+  int o;
+
+  for (o = order; o <= MAXORDER && n->free[o].next == &n->free[o]; o++)
+    ;
+  if (o > MAXORDER)
+    return 0;
+
+  p = n->free[o].next;
+  buddy_remove(n, p, o);
+
+  /* Give back the upper half until the block is the right size */
+  while (o > order) {
+    o--;
+    buddy_insert(n, (struct page *)((char *)p + (PGSIZE << o)), o);
+  }
+
+  return p;
+}
+
+/* Free a block of 2^order pages of node n, merging it with its buddy for
+ * as long as the buddy is a free block of the same size on the same
+ * node. Called with n->lock held.
+ */
+static void buddy_free(struct knode *n, struct page *p, int order)
+{
+  unsigned long i = PA2IDX(p), b;
+
+  for (; order < MAXORDER; order++) {
+    b = i ^ (1UL << order);
+    if (b >= kmem.npages || kmem.order[b] != order + 1 || kmem.nodeid[b] != kmem.nodeid[i])
+      break;
+
+    buddy_remove(n, IDX2PA(b), order);
+    i &= b;
+  }
+
+  buddy_insert(n, IDX2PA(i), order);
+}
+
+/* Allocate a block of 2^order pages for a hart on node local, from that
+ * node if it can, else from the others in turn.
+ */
+static struct page *node_alloc(int local, int order)
+{
+  struct knode *n;
+  struct page *p = 0;
+
+  for (int i = 0; i < nnode && !p; i++) {
+    n = &kmem.node[(local + i) % nnode];
+    acquire(&n->lock);
+    if ((p = buddy_alloc(n, order))) {
+      n->allocs += 1UL << order;
+      if (i > 0)
+        n->remote += 1UL << order;
+    }
+    release(&n->lock);
+  }
+
+  return p;
+}
+
+/* The block size of cbo.zero is not in any CSR: zero the first block of
+ * a page full of ones and count the bytes that were cleared. Returns 0
+ * if that is not a power of two.
+ */
+static int cbo_probe(unsigned char *pa)
+{
+  int n = 0;
+
+  memset(pa, 0xff, PGSIZE);
+  cbo_zero(pa);
+  while (n < PGSIZE && pa[n] == 0)
+    n++;
+
+  return n & (n - 1) ? 0 : n;
+}
+
 void kalloc_init()
 {
-  struct page *p = (struct page *)PGROUNDUP((unsigned long)end);
+  unsigned long i, n, start, end, first;
+  struct knode *nd;
+  int o, node;
+
+  for (nd = kmem.node; nd < &kmem.node[NNODE]; nd++) {
+    initlock(&nd->lock);
+    for (o = 0; o <= MAXORDER; o++)
+      nd->free[o].next = nd->free[o].prev = &nd->free[o];
+  }
+
+  kmem.npages = (phystop - KERNBASE) / PGSIZE;
+  kmem.ref = (int *)PGROUNDUP((unsigned long)end);
+  kmem.order = (unsigned char *)(kmem.ref + kmem.npages);
+  kmem.nodeid = kmem.order + kmem.npages;
+  first = PGROUNDUP((unsigned long)(kmem.nodeid + kmem.npages));
+  if (first > phystop)
+    panic("kalloc_init: no room");
+  memset(kmem.ref, 0, first - (unsigned long)kmem.ref);
+
+  /* Probe on the first free page before it is linked into a buddy list. */
+  if (zicboz)
+    cbo_blocksize = cbo_probe((unsigned char *)first);
+
+  /* Add the available pages of each region to its node's lists as the
+   * largest aligned blocks that fit.
+   */
+  for (int r = 0; fdt_memory(r, &start, &end, &node) == 0; r++) {
+    i = PA2IDX(PGROUNDUP(start > first ? start : first));
+    n = PA2IDX(end & ~(PGSIZE - 1));
+    memset(kmem.nodeid + i, node, n > i ? n - i : 0);
+    while (i < n) {
+      for (o = MAXORDER; o > 0 && ((i & ((1UL << o) - 1)) || i + (1UL << o) > n); o--)
+        ;
+      buddy_insert(&kmem.node[node], IDX2PA(i), o);
+      i += 1UL << o;
+    }
+  }
+
+  for (int id = 0; id < NCPU; id++) {
+    initlock(&kmem.cpu[id].lock);
+    kmem.cpu[id].node = fdt_cpunode(id);
+  }
+}
+
+/* Move up to n pages from the buddy lists to c, from its own node first.
+ * Called with c->lock held.
+ */
+static void kcache_refill(struct kmem_cpu *c, int n)
+{
+  struct knode *nd;
+  struct page *p;
+
+  for (int i = 0; i < nnode && n > 0; i++) {
+    nd = &kmem.node[(c->node + i) % nnode];
+    acquire(&nd->lock);
+    for (; n > 0 && (p = buddy_alloc(nd, 0)); n--) {
+      p->next = c->freelist;
+      c->freelist = p;
+      c->nfree++;
+      nd->allocs++;
+      if (i > 0)
+        nd->remote++;
+    }
+    release(&nd->lock);
+  }
+
+  c->refills++;
+}
+
+/* Move n pages from c back to the buddy lists. The cache holds pages of
+ * other nodes only if a refill had to borrow them.
+ * Called with c->lock held.
+ */
+static void kcache_drain(struct kmem_cpu *c, int n)
+{
+  struct knode *nd, *held = 0;
+  struct page *p;
+
+  while (n-- > 0 && (p = c->freelist)) {
+    c->freelist = p->next;
+    c->nfree--;
+    if ((nd = PA2NODE(p)) != held) {
+      if (held)
+        release(&held->lock);
+      acquire(&nd->lock);
+      held = nd;
+    }
+    buddy_free(nd, p, 0);
+  }
+  if (held)
+    release(&held->lock);
+
+  c->drains++;
+}
+
+/* Give every page cached by every hart, zeroed or not, back to the buddy
+ * lists so that it can merge again. Returns the number of pages moved.
+ */
+static int kcache_flush()
+{
+  struct kmem_cpu *c;
+  struct page *p;
+  int n = 0;
+
+  for (c = kmem.cpu; c < &kmem.cpu[NCPU]; c++) {
+    acquire(&c->lock);
+    while ((p = c->zerolist)) {
+      c->zerolist = p->next;
+      p->next = c->freelist;
+      c->freelist = p;
+      c->nfree++;
+    }
+    c->nzero = 0;
+    n += c->nfree;
+    kcache_drain(c, c->nfree);
+    release(&c->lock);
+  }
+
+  return n;
+}
+
+/* Take a page from c, from the zeroed pool if zero is set and it is not
+ * empty, otherwise preferring unzeroed pages. *zeroed tells which it was.
+ * Called with c->lock held.
+ */
+static struct page *kcache_get(struct kmem_cpu *c, bool zero, bool *zeroed)
+{
+  struct page *p;
+
+  if ((p = c->zerolist) && (zero || !c->freelist)) {
+    c->zerolist = p->next;
+    c->nzero--;
+    p->next = 0;
+    *zeroed = true;
+  } else if ((p = c->freelist)) {
+    c->freelist = p->next;
+    c->nfree--;
+    *zeroed = false;
+  }
+
+  return p;
+}
+
+/* The buddy lists are empty: take a page from another hart's cache. */
+static struct page *kcache_steal(int self, bool *zeroed)
+{
+  struct kmem_cpu *c;
+  struct page *p = 0;
+
+  for (int i = 0; i < ncpu && !p; i++) {
+    if (i == self)
+      continue;
 
-  /* Add all available pages to the free list */
-  for (; p + PGSIZE <= (struct page *)PHYSTOP; p += PGSIZE) {
-    p->next = kmem.freelist;
-    kmem.freelist = p;
+    c = &kmem.cpu[i];
+    acquire(&c->lock);
+    p = kcache_get(c, false, zeroed);
+    release(&c->lock);
+  }
+
+  return p;
+}
+
+/* Zero a page, a cache block at a time with Zicboz, else a doubleword at a time. */
+static void pgzero(void *pa)
+{
+  if (cbo_blocksize) {
+    for (char *b = pa; b < (char *)pa + PGSIZE; b += cbo_blocksize)
+      cbo_zero(b);
+    return;
   }
 
-  initlock(&kmem.lock);
+  for (unsigned long *w = pa; w < (unsigned long *)((char *)pa + PGSIZE); w++)
+    *w = 0;
 }
 
-/* Give page back to the free list */
+static void kcheck(void *pa, int order, char *who)
+{
+  if (((unsigned long)pa % PGSIZE) != 0 || (char*)pa < end || (unsigned long)pa >= phystop ||
+      PA2IDX(pa) % (1UL << order) != 0)
+    panic(who);
+}
+
+/* Drop a reference to a page; give it back to this hart's cache if that was the last one */
 void kfree(void *pa)
 {
   struct page *p = pa;
+  struct kmem_cpu *c;
+  struct knode *nd;
+  int ref;
 
-  if (((unsigned long)pa % PGSIZE) != 0 || (char*)pa < end || (unsigned long)pa >= PHYSTOP)
-    panic("kfree: page not aligned or out of bounds");
+  kcheck(pa, 0, "kfree: page not aligned or out of bounds");
 
-  acquire(&kmem.lock);
-  p->next = kmem.freelist;
-  kmem.freelist = p;
-  release(&kmem.lock);
+  if ((ref = __sync_sub_and_fetch(&kmem.ref[PA2IDX(pa)], 1)) > 0)
+    return;
+  if (ref < 0)
+    panic("kfree: page not allocated");
+
+  push_off();
+  c = &kmem.cpu[cpuid()];
+  nd = PA2NODE(pa);
+  if (nd != &kmem.node[c->node]) {
+    /* Keep the cache for pages of this hart's node. */
+    pop_off();
+    acquire(&nd->lock);
+    buddy_free(nd, p, 0);
+    release(&nd->lock);
+    return;
+  }
+  acquire(&c->lock);
+  p->next = c->freelist;
+  c->freelist = p;
+  if (++c->nfree >= KCACHE_MAX)
+    kcache_drain(c, KCACHE_BATCH);
+  release(&c->lock);
+  pop_off();
 }
 
-/* Returns one 4K page from the free list */
+static void *kalloc_page(bool zero)
+{
+  struct kmem_cpu *c;
+  struct page *r;
+  bool zeroed;
+  int id;
+
+  push_off();
+  id = cpuid();
+  c = &kmem.cpu[id];
+  acquire(&c->lock);
+  if (!c->freelist && !(zero && c->zerolist))
+    kcache_refill(c, KCACHE_BATCH);
+
+  if ((r = kcache_get(c, zero, &zeroed)) && zero && zeroed)
+    c->zerohits++;
+  release(&c->lock);
+
+  if (!r)
+    r = kcache_steal(id, &zeroed);
+  pop_off();
+
+  if (r) {
+    kmem.ref[PA2IDX(r)] = 1;
+    if (zero && !zeroed)
+      pgzero(r);
+  }
+
+  return (void*)r;
+}
+
+/* Returns one zeroed 4K page, or 0 if memory is exhausted */
 void *kalloc()
+{
+  return kalloc_page(true);
+}
+
+/* Like kalloc(), but the page's contents are garbage. */
+void *kalloc_nozero()
+{
+  return kalloc_page(false);
+}
+
+/* Called by a hart with nothing to run: zero one free page into its pool.
+ * Returns 0 if the pool is full or there is no free page.
+ */
+int kalloc_idle()
+{
+  struct kmem_cpu *c;
+  struct page *p = 0;
+
+  push_off();
+  c = &kmem.cpu[cpuid()];
+  acquire(&c->lock);
+  if (c->nzero < KZERO_MAX) {
+    if (!c->freelist)
+      kcache_refill(c, KCACHE_BATCH);
+    if ((p = c->freelist)) {
+      c->freelist = p->next;
+      c->nfree--;
+    }
+  }
+  release(&c->lock);
+
+  if (p) {
+    pgzero(p);
+    acquire(&c->lock);
+    p->next = c->zerolist;
+    c->zerolist = p;
+    c->nzero++;
+    release(&c->lock);
+  }
+  pop_off();
+
+  return p != 0;
+}
+
+/* Returns 2^order physically contiguous pages, aligned to their size,
+ * or 0 if no block that large is free.
+ */
+void *kalloc_pages(int order)
 {
   struct page *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if (r)
-    kmem.freelist = kmem.freelist->next;
-  release(&kmem.lock);
+  if (order == 0)
+    return kalloc();
+  if (order < 0 || order > MAXORDER)
+    return 0;
+
+  push_off();
+  r = node_alloc(kmem.cpu[cpuid()].node, order);
+  pop_off();
+
+  /* The free pages the harts hold may complete a block. */
+  if (!r && kcache_flush() > 0) {
+    push_off();
+    r = node_alloc(kmem.cpu[cpuid()].node, order);
+    pop_off();
+  }
 
-  memset(r, 0, PGSIZE);
+  if (r) {
+    kmem.ref[PA2IDX(r)] = 1;
+    for (int i = 0; i < 1 << order; i++)
+      pgzero((char *)r + i * PGSIZE);
+  }
 
   return (void*)r;
 }
+
+/* Drop a reference to a block from kalloc_pages(order); free it if that was the last one */
+void kfree_pages(void *pa, int order)
+{
+  struct knode *nd;
+  int ref;
+
+  if (order == 0) {
+    kfree(pa);
+    return;
+  }
+
+  kcheck(pa, order, "kfree_pages: block not aligned or out of bounds");
+
+  if ((ref = __sync_sub_and_fetch(&kmem.ref[PA2IDX(pa)], 1)) > 0)
+    return;
+  if (ref < 0)
+    panic("kfree_pages: block not allocated");
+
+  nd = PA2NODE(pa);
+  acquire(&nd->lock);
+  buddy_free(nd, pa, order);
+  release(&nd->lock);
+}
+
+/* Turn a block from kalloc_pages(order) into 2^order single pages,
+ * each with the block's reference count, to be freed with kfree().
+ */
+void kalloc_split(void *pa, int order)
+{
+  unsigned long i = PA2IDX(pa);
+
+  kcheck(pa, order, "kalloc_split");
+
+  for (unsigned long j = 1; j < 1UL << order; j++)
+    kmem.ref[i + j] = kmem.ref[i];
+}
+
+/* Take another reference to an allocated page */
+void kpage_ref(void *pa)
+{
+  kcheck(pa, 0, "kpage_ref");
+
+  if (__sync_fetch_and_add(&kmem.ref[PA2IDX(pa)], 1) < 1)
+    panic("kpage_ref: page not allocated");
+}
+
+/* Number of references held on an allocated page */
+int kpage_refcount(void *pa)
+{
+  kcheck(pa, 0, "kpage_refcount");
+
+  return __atomic_load_n(&kmem.ref[PA2IDX(pa)], __ATOMIC_ACQUIRE);
+}
+
+/* The NUMA node of an allocated page */
+int kpage_node(void *pa)
+{
+  kcheck(pa, 0, "kpage_node");
+
+  return kmem.nodeid[PA2IDX(pa)];
+}
+
+/* Fill in the allocator fields of a memstat snapshot. */
+void kalloc_stats(struct memstat *ms)
+{
+  struct kmem_cpu *c;
+  struct knode *nd;
+  unsigned long top = 0;
+
+  ms->freepages = 0;
+  ms->nnode = nnode;
+  for (int o = 0; o <= MAXORDER; o++)
+    ms->freeblocks[o] = 0;
+  for (int n = 0; n < NNODE; n++) {
+    nd = &kmem.node[n];
+    ms->nodefree[n] = 0;
+    acquire(&nd->lock);
+    for (int o = 0; o <= MAXORDER; o++) {
+      ms->freeblocks[o] += nd->nfree[o];
+      ms->nodefree[n] += nd->nfree[o] << o;
+    }
+    top += nd->nfree[MAXORDER] << MAXORDER;
+    ms->nodeallocs[n] = nd->allocs;
+    ms->noderemote[n] = nd->remote;
+    release(&nd->lock);
+    ms->freepages += ms->nodefree[n];
+  }
+
+  ms->refills = ms->drains = ms->zeropages = ms->zerohits = 0;
+  for (c = kmem.cpu; c < &kmem.cpu[NCPU]; c++) {
+    acquire(&c->lock);
+    ms->freepages += c->nfree + c->nzero;
+    ms->refills += c->refills;
+    ms->drains += c->drains;
+    ms->zeropages += c->nzero;
+    ms->zerohits += c->zerohits;
+    release(&c->lock);
+  }
+
+  /* Share of free memory, in tenths of a percent, that cannot be used
+   * for a MAXORDER allocation.
+   */
+  ms->frag = ms->freepages ? 1000 - top * 1000 / ms->freepages : 0;
+}
@@ -9,14 +9,20 @@ void main()
   if (cpuid() == 0) {
     console_init();
     printf_init();
+    fdt_init(boot_fdt);
     kalloc_init();
+    string_init();
+    slab_init();
     kvm_init();
     proc_init();
     trap_init();
     plic_init();
     bufcache_init();
     inode_init();
+    vma_init();
     file_init();
+    pipe_init();
+    shm_init();
     virtio_disk_init();
     user_init();
     started = true;
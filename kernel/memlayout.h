@@ -14,8 +14,8 @@
 
 // the kernel uses physical memory thus:
 // 80000000 -- entry.S, then kernel text and data
-// end -- start of kernel page allocation area
-// PHYSTOP -- end RAM used by the kernel
+// end -- per-page allocator state, then the page allocation area
+// phystop -- end of RAM, as found in the device tree
 
 // qemu puts UART registers here in physical memory.
 #define UART0 0x10000000L
@@ -43,9 +43,11 @@
 
 // the kernel expects there to be RAM
 // for use by the kernel and user pages
-// from physical address 0x80000000 to PHYSTOP.
+// from physical address 0x80000000 to phystop.
+// RAM above PHYSMAX is left unused, so that
+// the direct map stays clear of the kernel stacks.
 #define KERNBASE 0x80000000L
-#define PHYSTOP (KERNBASE + 128*1024*1024)
+#define PHYSMAX (MAXVA / 2)
 
 // map the trampoline page to the highest address,
 // in both user and kernel space.
@@ -55,6 +57,11 @@
 // each surrounded by invalid guard pages.
 #define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
 
+// with make SUM=1, each hart's kernel page table also maps
+// the user memory of the process it runs, at UWINDOW plus
+// the user address, in the upper half of the Sv39 space.
+#define UWINDOW (-MAXVA)
+
 // User memory layout.
 // Address zero first:
 //   text
@@ -0,0 +1,19 @@
+// System-wide memory statistics, filled in by the memstat() system call.
+struct memstat {
+  unsigned long freepages; // free physical pages, including per-cpu caches
+  unsigned long refills;   // per-cpu cache refills from the buddy lists
+  unsigned long drains;    // per-cpu cache drains to the buddy lists
+  unsigned long freeblocks[MAXORDER+1]; // free buddy blocks of each order
+  unsigned long frag;      // per mille of free pages not in a MAXORDER block
+  unsigned long slabpages; // pages held by kernel object caches
+  unsigned long zeropages; // free pages zeroed ahead of time by idle harts
+  unsigned long zerohits;  // kalloc() calls served from those pages
+  unsigned long pageins;   // pages read back from swap
+  unsigned long pageouts;  // pages written out to swap
+  unsigned long swapused;  // swap slots in use
+  unsigned long zeromaps;  // user mappings of the shared zero page
+  unsigned long nnode;     // NUMA nodes
+  unsigned long nodefree[NNODE];   // pages on each node's buddy lists
+  unsigned long nodeallocs[NNODE]; // pages taken from each node's lists
+  unsigned long noderemote[NNODE]; // of those, pages for a hart on another node
+};
@@ -1,13 +1,21 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC      4096  // maximum number of processes; allocated as needed
 #define NCPU          8  // maximum number of CPUs
+#define NMEMREGION    8  // maximum number of RAM regions
+#define NNODE         4  // maximum number of NUMA nodes
+#define MAXORDER     10  // largest physical allocation is 2^MAXORDER pages
 #define NOFILE       16  // open files per process
+#define NVMA          8  // demand-paged regions per process
+#define NSHM         16  // shared memory segments per system
+#define SHMPAGES   4096  // maximum pages in a shared memory segment
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define USERSTACK   256  // max pages of user stack, at most 512
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
+#define SWAPPAGES    4096  // pages of swap space after the file system
 #define MAXPATH      128   // maximum file path name
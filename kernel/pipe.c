@@ -18,6 +18,14 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+static struct kmem_cache *pipe_cache;
+
+void
+pipe_init()
+{
+  pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -27,7 +35,7 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if ((*f0 = file_alloc()) == 0 || (*f1 = file_alloc()) == 0)
     goto bad;
-  if ((pi = (struct pipe*)kalloc()) == 0)
+  if ((pi = kmem_cache_alloc(pipe_cache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -46,7 +54,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if (pi)
-    kfree((char*)pi);
+    kmem_cache_free(pipe_cache, pi);
   if (*f0)
     file_close(*f0);
   if (*f1)
@@ -67,36 +75,45 @@ pipeclose(struct pipe *pi, int writable)
   }
   if (pi->readopen == 0 && pi->writeopen == 0) {
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(pipe_cache, pi);
   } else
     release(&pi->lock);
 }
 
+// Data is staged through a small buffer on the kernel stack so that
+// user memory is never touched while pi->lock is held: a copy may fault
+// a page in from a file, which sleeps.
+#define PIPECHUNK 128
+
 int
 pipewrite(struct pipe *pi, unsigned long addr, int n)
 {
-  int i = 0;
+  int i = 0, j, m;
   struct proc *pr = myproc();
+  char buf[PIPECHUNK];
 
-  acquire(&pi->lock);
   while (i < n) {
-    if (pi->readopen == 0 || killed(pr)) {
-      release(&pi->lock);
-      return -1;
-    }
-    if (pi->nwrite == pi->nread + PIPESIZE) { //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if (copy_from_user(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+    m = n - i < PIPECHUNK ? n - i : PIPECHUNK;
+    if (copy_from_user(pr->pagetable, buf, addr + i, m) == -1)
+      break;
+
+    acquire(&pi->lock);
+    for (j = 0; j < m; ) {
+      if (pi->readopen == 0 || killed(pr)) {
+        release(&pi->lock);
+        return -1;
+      }
+      if (pi->nwrite == pi->nread + PIPESIZE) { //DOC: pipewrite-full
+        wakeup(&pi->nread);
+        sleep(&pi->nwrite, &pi->lock);
+      } else {
+        pi->data[pi->nwrite++ % PIPESIZE] = buf[j++];
+      }
     }
+    wakeup(&pi->nread);
+    release(&pi->lock);
+    i += m;
   }
-  wakeup(&pi->nread);
-  release(&pi->lock);
 
   return i;
 }
@@ -106,7 +123,7 @@ piperead(struct pipe *pi, unsigned long addr, int n)
 {
   int i;
   struct proc *pr = myproc();
-  char ch;
+  char buf[PIPECHUNK];
 
   acquire(&pi->lock);
   while (pi->nread == pi->nwrite && pi->writeopen) {  //DOC: pipe-empty
@@ -116,14 +133,15 @@ piperead(struct pipe *pi, unsigned long addr, int n)
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for (i = 0; i < n; i++) {  //DOC: piperead-copy
+  for (i = 0; i < n && i < PIPECHUNK; i++) {  //DOC: piperead-copy
     if (pi->nread == pi->nwrite)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if (copy_to_user(pr->pagetable, addr + i, &ch, 1) == -1)
-      break;
+    buf[i] = pi->data[pi->nread++ % PIPESIZE];
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
+
+  if (copy_to_user(pr->pagetable, addr, buf, i) == -1)
+    return -1;
   return i;
 }
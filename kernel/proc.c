@@ -9,7 +9,26 @@
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+/* Every proc struct ever created, newest first. Structs are never
+ * freed, only recycled through ptable.free, so the list can be walked
+ * without a lock and a pointer to a proc always points to a proc.
+ */
+static struct proc *procs;
+
+#define for_each_proc(p) \
+  for (p = __atomic_load_n(&procs, __ATOMIC_ACQUIRE); p; p = p->next)
+
+/* Up to NSPARE free procs keep their kernel stacks, so that the next forks need not map new ones. */
+#define NSPARE 16
+
+static struct {
+  struct spinlock lock;
+  struct proc *free;      /* UNUSED procs */
+  int nfree;              /* ... of which have a kernel stack */
+  int n;                  /* Proc structs created, at most NPROC */
+} ptable;
+
+static struct kmem_cache *proc_cache;
 
 struct proc *initproc;
 
@@ -23,38 +42,13 @@ extern char trampoline[];
 
 struct spinlock wait_lock;
 
-/* Allocate a page for each process's kernel stack.
- * Map it high in memory, followed by an invalid guard page.
- */
-void proc_mapstacks(unsigned long * kpgtbl)
-{
-  unsigned long va;
-  struct proc *p;
-  char *pa;
-  
-  for (p = proc; p < &proc[NPROC]; p++) {
-    pa = kalloc();
-    if (!pa)
-      panic("kalloc");
-
-    va = KSTACK((int) (p - proc));
-    kvm_map(kpgtbl, va, (unsigned long)pa, PGSIZE, PTE_R | PTE_W);
-  }
-}
-
 /* Initialize the process table */
 void proc_init()
 {
-  struct proc *p;
-  
   initlock(&pid_lock);
   initlock(&wait_lock);
-
-  for (p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock);
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
-  }
+  initlock(&ptable.lock);
+  proc_cache = kmem_cache_create("proc", sizeof(struct proc));
 }
 
 /* Must be called with interrupts disabled */
@@ -87,25 +81,56 @@ static int allocpid()
   return pid;
 }
 
-/* Look in the process table for an UNUSED proc.
- * If found, initialize state required to run in the kernel,
- * and return with p->lock held.
+/* Create a new proc struct, if the table has room. */
+static struct proc * proc_grow()
+{
+  struct proc *p;
+
+  if (!(p = kmem_cache_alloc(proc_cache)))
+    return 0;
+
+  acquire(&ptable.lock);
+  if (ptable.n == NPROC) {
+    release(&ptable.lock);
+    kmem_cache_free(proc_cache, p);
+    return 0;
+  }
+  p->slot = ptable.n++;
+  initlock(&p->lock);
+  p->state = UNUSED;
+  p->next = procs;
+  __atomic_store_n(&procs, p, __ATOMIC_RELEASE);
+  release(&ptable.lock);
+
+  return p;
+}
+
+/* Take an UNUSED proc off the free list, or create one, and give it a
+ * kernel stack if it has none. If found, initialize state required to
+ * run in the kernel, and return with p->lock held.
  */
 static struct proc * allocproc()
 {
   struct proc *p;
 
-  for (p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if (p->state == UNUSED)
-      goto found;
-    else
-      release(&p->lock);
+  acquire(&ptable.lock);
+  if ((p = ptable.free)) {
+    ptable.free = p->nextfree;
+    if (p->kstack)
+      ptable.nfree--;
   }
+  release(&ptable.lock);
 
-  return 0;
+  if (!p && !(p = proc_grow()))
+    return 0;
+
+  acquire(&p->lock);
+  if (!p->kstack && !(p->kstack = kvm_stack_alloc(KSTACK(p->slot)))) {
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
 
-found:
   p->pid = allocpid();
   p->state = USED;
 
@@ -133,6 +158,16 @@ found:
   p->ticks = 0;
   p->alarmhandler = 0;
   p->tickets = 1;
+  p->minflt = 0;
+  p->majflt = 0;
+  p->ilocks = 0;
+  p->asid_gen = 0;  /* The last user of this slot may still have entries in some TLB */
+  p->kpreempt = 0;
+  p->swapva = 0;
+  p->hugepages = 0;
+  p->node = 0;
+  p->numava = 0;
+  memset(p->numapages, 0, sizeof(p->numapages));
 
   return p;
 }
@@ -144,9 +179,13 @@ static void freeproc(struct proc *p)
     kfree((void*)p->trapframe);
 
   if (p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
+    proc_freepagetable(p->pagetable);
+
+  if (p->vstate)
+    kfree_pages(p->vstate, vstate_order);
 
   p->trapframe = 0;
+  p->vstate = 0;
   p->pagetable = 0;
   p->sz = 0;
   p->pid = 0;
@@ -156,6 +195,17 @@ static void freeproc(struct proc *p)
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+
+  acquire(&ptable.lock);
+  if (p->kstack && ptable.nfree == NSPARE) {
+    kvm_stack_free(p->kstack);
+    p->kstack = 0;
+  }
+  if (p->kstack)
+    ptable.nfree++;
+  p->nextfree = ptable.free;
+  ptable.free = p;
+  release(&ptable.lock);
 }
 
 /* Create a user page table for a given process with trampoline and trapframe pages. */
@@ -168,25 +218,25 @@ unsigned long * proc_pagetable(struct proc *p)
 
   if (mappages(pagetable, TRAMPOLINE, PGSIZE,
               (unsigned long)trampoline, PTE_R | PTE_X) < 0) {
-    uvm_free(pagetable, 0);
+    uvm_free(pagetable);
     return 0;
   }
 
   if (mappages(pagetable, TRAPFRAME, PGSIZE,
               (unsigned long)(p->trapframe), PTE_R | PTE_W) < 0) {
     uvm_unmap(pagetable, TRAMPOLINE, 1, 0);
-    uvm_free(pagetable, 0);
+    uvm_free(pagetable);
     return 0;
   }
 
   return pagetable;
 }
 
-void proc_freepagetable(unsigned long * pagetable, unsigned long sz)
+void proc_freepagetable(unsigned long * pagetable)
 {
   uvm_unmap(pagetable, TRAMPOLINE, 1, 0);
   uvm_unmap(pagetable, TRAPFRAME, 1, 0);
-  uvm_free(pagetable, sz);
+  uvm_free(pagetable);
 }
 
 /* a user program that calls exec("/init") */
@@ -229,11 +279,12 @@ int growproc(int n)
   struct proc *p = myproc();
   unsigned long sz;
 
+  /* Growing only reserves address space; uvm_fault() allocates pages on first touch. */
   sz = p->sz;
   if (n > 0) {
-    sz = uvm_alloc(p->pagetable, sz, sz + n, PTE_W);
-    if (!sz)
+    if (sz + n < sz || sz + n > TRAPFRAME || vma_overlap(p, PGROUNDUP(sz), sz + n))
       return -1;
+    sz += n;
   } else if (n < 0) {
     sz = uvm_dealloc(p->pagetable, sz, sz + n);
   }
@@ -262,7 +313,14 @@ int fork()
   }
 
   np->sz = p->sz;
+  if (vma_copy(np, p) < 0) {
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   np->tickets = p->tickets;
+  np->node = p->node;  /* The child shares its parent's pages for now */
 
   /* Copy saved user registers. */
   *(np->trapframe) = *(p->trapframe);
@@ -297,7 +355,9 @@ int fork()
 /* Pass p's abandoned children to init. */
 void reparent(struct proc *p)
 {
-  for (struct proc *pp = proc; pp < &proc[NPROC]; pp++) {
+  struct proc *pp;
+
+  for_each_proc(pp) {
     if (pp->parent == p) {
       pp->parent = initproc;
       wakeup(initproc);
@@ -321,8 +381,12 @@ void exit(int status)
     }
   }
 
+  /* Write shared mappings back and drop them; this needs its own transactions. */
+  vma_unmap(p, 0, MAXVA);
+
   begin_op();
   iput(p->cwd);
+  vma_release(p->vma);
   end_op();
   p->cwd = 0;
 
@@ -347,31 +411,30 @@ void exit(int status)
 int wait(unsigned long addr)
 {
   struct proc *pp, *p = myproc();
-  int havekids, pid;
+  int havekids, pid, xstate;
 
   acquire(&wait_lock);
 
   for (;;) {
     // Scan through table looking for exited children.
     havekids = 0;
-    for (pp = proc; pp < &proc[NPROC]; pp++) {
+    for_each_proc(pp) {
       if (pp->parent == p) {
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
 
         havekids = 1;
         if (pp->state == ZOMBIE) {
-          // Found one.
+          // Found one. Copy the status out once no locks are held,
+          // since touching user memory may fault pages in.
           pid = pp->pid;
-          if (addr != 0 && copy_to_user(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
+          xstate = pp->xstate;
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
+          if (addr != 0 && copy_to_user(p->pagetable, addr, (char *)&xstate,
+                                  sizeof(xstate)) < 0)
+            return -1;
           return pid;
         }
         release(&pp->lock);
@@ -397,44 +460,68 @@ int wait(unsigned long addr)
  *  - eventually that process transfers control
  *    via swtch back to the scheduler.
  */
+#define NUMA_LOCAL 4  /* Ticket multiplier for processes whose memory is on the hart's node */
+
+/* p's tickets in a lottery drawn by a hart on node. A process has more
+ * chances on the node that holds most of its memory, but some anywhere.
+ */
+static unsigned long numa_tickets(struct proc *p, int node)
+{
+  return p->node == node ? p->tickets * NUMA_LOCAL : p->tickets;
+}
+
 void scheduler()
 {
-  unsigned long total_tickets = 0, winner;
+  unsigned long total_tickets, winner;
   struct cpu *c = mycpu();
-  int i, tickets[NPROC];
+  int node = fdt_cpunode(cpuid());
   struct proc *p;
   
   c->proc = 0;
   for (;;) {
     intr_on();
 
-    for (i = 0; i < NPROC; i++) {
-      if (proc[i].state != RUNNABLE) {
-        continue;
-      }
-      total_tickets += proc[i].tickets;
-      tickets[i] = total_tickets;
+    total_tickets = 0;
+    for_each_proc(p)
+      if (p->state == RUNNABLE)
+        total_tickets += numa_tickets(p, node);
+
+    /* Nothing to run: zero free pages for kalloc() instead. */
+    if (total_tickets == 0) {
+      kalloc_idle();
+      continue;
     }
 
+    /* Find the runnable process holding the winning ticket. Processes
+     * may have stopped being runnable since the count; then try again. */
     winner = rand() % total_tickets;
-
-    for (i = 0; i < NPROC; i++) {
-      if (tickets[i] > winner) {
-        p = &proc[i];
+    for_each_proc(p) {
+      if (p->state != RUNNABLE)
+        continue;
+      if (winner < numa_tickets(p, node))
         break;
-      }
-      if (i == NPROC - 1)
-        p = &proc[i-1];
+      winner -= numa_tickets(p, node);
     }
+    if (!p)
+      continue;
 
     acquire(&p->lock);
     if (p->state == RUNNABLE) {
+      /* Its kernel stack may have been mapped after this hart last looked. */
+      kvm_sync();
+
       p->state = RUNNING;
       c->proc = p;
+#ifdef SUM
+      uvm_window(p->pagetable);
+#endif
       swtch(&c->context, &p->context);
 
       /* Process is done running for now. */
       c->proc = 0;
+#ifdef SUM
+      uvm_window(0);
+#endif
     }
     release(&p->lock);
   }
@@ -512,7 +599,9 @@ void sleep(void *channel, struct spinlock *lk)
 /* Wake up all processes sleeping on channel. */
 void wakeup(void *channel)
 {
-  for (struct proc *p = proc; p < &proc[NPROC]; p++) {
+  struct proc *p;
+
+  for_each_proc(p) {
     if (p != myproc()) {
       acquire(&p->lock);
       if (p->state == SLEEPING && p->channel == channel)
@@ -525,7 +614,9 @@ void wakeup(void *channel)
 /* Kill the process */
 int kill(int pid)
 {
-  for (struct proc *p = proc; p < &proc[NPROC]; p++) {
+  struct proc *p;
+
+  for_each_proc(p) {
     acquire(&p->lock);
     if (p->pid == pid) {
       p->killed = 1;
@@ -596,7 +687,7 @@ void procdump()
   char *state;
 
   printf("\n");
-  for (p = proc; p < &proc[NPROC]; p++) {
+  for_each_proc(p) {
     if (p->state == UNUSED)
       continue;
     if (p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -608,13 +699,90 @@ void procdump()
   }
 }
 
-void procinfo(struct pstat *ps)
+/* Copy one int into a struct pstat in user space. */
+static int pstat_put(int *dst, int v)
 {
-  for (struct proc *p = &proc[0]; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      ps->tickets[&proc[NPROC] - p] = p->tickets;
-      ps->ticks[&proc[NPROC] - p] = p->ticks;
-      ps->pid[&proc[NPROC] - p] = p->pid;
-      release(&p->lock);
+  return copy_to_user(myproc()->pagetable, (unsigned long)dst, (char *)&v, sizeof(v));
+}
+
+/* Fill in the struct pstat at user address addr, one proc struct per
+ * slot. Slots never used read as zero. The table is too large to stage
+ * on the kernel stack, so each value is copied out on its own.
+ */
+int procinfo(unsigned long addr)
+{
+  struct pstat *ps = (struct pstat *)addr;
+  int tickets, ticks, pid, minflt, majflt, hugepages, node, i;
+  struct proc *p;
+  char *zero;
+
+  if (!(zero = kalloc()))
+    return -1;
+  for (i = 0; i < sizeof(struct pstat); i += PGSIZE) {
+    if (copy_to_user(myproc()->pagetable, addr + i, zero,
+                     sizeof(struct pstat) - i < PGSIZE ? sizeof(struct pstat) - i : PGSIZE) < 0) {
+      kfree(zero);
+      return -1;
     }
-}
\ No newline at end of file
+  }
+  kfree(zero);
+
+  for_each_proc(p) {
+    acquire(&p->lock);
+    tickets = p->tickets;
+    ticks = p->ticks;
+    pid = p->pid;
+    minflt = p->minflt;
+    majflt = p->majflt;
+    hugepages = p->hugepages;
+    node = p->node;
+    release(&p->lock);
+
+    i = p->slot;
+    if (pstat_put(&ps->tickets[i], tickets) < 0 || pstat_put(&ps->ticks[i], ticks) < 0 ||
+        pstat_put(&ps->pid[i], pid) < 0 || pstat_put(&ps->minflt[i], minflt) < 0 ||
+        pstat_put(&ps->majflt[i], majflt) < 0 || pstat_put(&ps->hugepages[i], hugepages) < 0 ||
+        pstat_put(&ps->node[i], node) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Where proc_evict() starts looking next. */
+static struct proc *swaphand;
+
+/* Find a page to swap out to slot, trying each process at most once,
+ * round robin. Kernel code holds a reference to any page of its process
+ * it keeps using across a sleep (see uvm_cow()), and uvm_evict() skips
+ * shared pages, so the caller and every process stopped at a sleep
+ * qualify: those that sleep, those woken up that have not run since,
+ * and those that have not run yet or were preempted in user space.
+ * Kernel code preempted by kerneltrap() (kpreempt) may be in the middle
+ * of using its process's pages, so it does not qualify.
+ * Returns the page, unmapped, or 0.
+ */
+void *proc_evict(int slot)
+{
+  struct proc *p, *start;
+  void *pa = 0;
+
+  start = __atomic_load_n(&swaphand, __ATOMIC_RELAXED);
+  if (!start)
+    start = __atomic_load_n(&procs, __ATOMIC_ACQUIRE);
+
+  p = start;
+  do {
+    acquire(&p->lock);
+    if (p->pagetable && (p == myproc() || p->state == SLEEPING ||
+                         (p->state == RUNNABLE && !p->kpreempt)))
+      pa = uvm_evict(p, slot);
+    release(&p->lock);
+
+    if (!(p = p->next))
+      p = __atomic_load_n(&procs, __ATOMIC_ACQUIRE);
+  } while (!pa && p != start);
+
+  __atomic_store_n(&swaphand, p, __ATOMIC_RELAXED);
+  return pa;
+}
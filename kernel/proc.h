@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  unsigned long asid_gen;     // ASID generation this hart's TLB has been flushed for
+  unsigned long kstack_gen;   // Kernel stack mappings this hart's TLB has caught up with
+  unsigned long *kpagetable;  // Root with the user window, make SUM=1 only
 };
 
 extern struct cpu cpus[NCPU];
@@ -77,6 +80,23 @@ struct trapframe {
   /* 264 */ unsigned long t4;
   /* 272 */ unsigned long t5;
   /* 280 */ unsigned long t6;
+  /* 288 */ unsigned long kernel_fence;  // flush the TLB on entry: no ASIDs
+};
+
+// A file-backed region of a user address space whose pages are read in
+// by vma_fault() on first touch. exec() records one per ELF segment.
+struct vma {
+  enum { VMA_NONE, VMA_EXEC, VMA_FILE, VMA_ANON, VMA_SHM } type; // VMA_NONE if the slot is free
+  unsigned long start;         // Page-aligned first address
+  unsigned long end;           // One past the last address
+  int perm;                    // PTE permission bits for the pages
+  int flags;                   // MAP_SHARED or MAP_PRIVATE, for mmap() regions
+  struct inode *ip;            // Backing file, or 0 for anonymous memory
+  unsigned long off;           // File offset that start maps to
+  unsigned long filesz;        // Bytes backed by the file, the rest is zero; for mmap(), as far as it reaches
+  struct shm *shm;             // Attached segment, for VMA_SHM; off is into it
+  struct uffd *uffd;           // Descriptor its faults go to, see uffd.c
+  int uffdmode;                // UFFD_MISSING and/or UFFD_WP
 };
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
@@ -95,17 +115,39 @@ struct proc {
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // ptable.lock must be held when using these:
+  struct proc *nextfree;       // Next UNUSED proc on the free list
+  unsigned long kstack;        // Kernel stack address, 0 if none; changes only while UNUSED
+
+  // set once when the proc struct is created:
+  struct proc *next;           // Next in procs, the list of every proc struct
+  int slot;                    // Index into getpinfo()'s arrays; decides KSTACK()
+
   // these are private to the process, so p->lock need not be held.
-  unsigned long kstack;               // Virtual address of kernel stack
   unsigned long sz;                   // Size of process memory (bytes)
   unsigned long * pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Demand-paged regions
   char name[16];               // Process name (debugging)
   int tickets;                 // Tickets to the lottery
   int alarmticks;              // Alarm interval
   void (*alarmhandler)();      // Alarm handler
   int ticks;                   // Ticks passed
+  int minflt;                  // Page faults resolved without I/O
+  int majflt;                  // Page faults that read from a file or swap
+  int ilocks;                  // Inode locks held, see vma_fault()
+  unsigned long asid;          // Tags this process's TLB entries
+  unsigned long asid_gen;      // Generation asid belongs to
+  int last_cpu;                // Hart that last ran this process in user space
+  int tlbdirty;                // Fence asid before returning to user space
+  void *vstate;                // Saved vector registers, once the process uses them
+  int kpreempt;                // Preempted in the kernel, see proc_evict()
+  unsigned long swapva;        // Where uvm_evict() resumes its scan
+  int hugepages;               // Megapages mapped in the heap
+  int node;                    // NUMA node holding most of its pages, see uvm_numa()
+  unsigned long numava;        // Where uvm_numa() resumes its scan
+  int numapages[NNODE];        // Pages seen on each node so far this scan
 };
@@ -2,4 +2,8 @@ struct pstat {
   int tickets[NPROC]; // the number of tickets this process has
   int pid[NPROC];     // the PID of each process 
   int ticks[NPROC];   // the number of ticks each process has accumulated 
+  int minflt[NPROC];  // page faults resolved without I/O
+  int majflt[NPROC];  // page faults that read from a file or swap
+  int hugepages[NPROC]; // 2M pages mapped in the heap
+  int node[NPROC];      // NUMA node holding most of its memory
 };
\ No newline at end of file
@@ -16,6 +16,7 @@ r_mhartid()
 #define MSTATUS_MPP_S (1L << 11)
 #define MSTATUS_MPP_U (0L << 11)
 #define MSTATUS_MIE (1L << 3)    // machine-mode interrupt enable.
+#define MSTATUS_VS_INITIAL (1L << 9) // vector unit on, registers clean.
 
 static inline unsigned long
 r_mstatus()
@@ -47,6 +48,9 @@ w_mepc(unsigned long x)
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
 #define SSTATUS_SIE (1L << 1)  // Supervisor Interrupt Enable
 #define SSTATUS_UIE (1L << 0)  // User Interrupt Enable
+#define SSTATUS_VS (3L << 9)   // Vector unit state, 0=Off (or no vector unit)
+#define SSTATUS_VS_CLEAN (2L << 9) // Vector registers not written since saved
+#define SSTATUS_SUM (1L << 18) // Supervisor may access User memory
 
 static inline unsigned long
 r_sstatus()
@@ -62,6 +66,16 @@ w_sstatus(unsigned long x)
   __asm__ volatile("csrw sstatus, %0" : : "r" (x));
 }
 
+// Vector register length in bytes, on harts with the V extension
+// (by number, for assemblers without it)
+static inline unsigned long
+r_vlenb()
+{
+  unsigned long x;
+  __asm__ volatile("csrr %0, 0xc22" : "=r" (x) );
+  return x;
+}
+
 // Supervisor Interrupt Pending
 static inline unsigned long
 r_sip()
@@ -201,6 +215,11 @@ w_pmpaddr0(unsigned long x)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((unsigned long)pagetable) >> 12))
 
+// address space identifier, which tags the TLB entries made under satp.
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK (0xffffL << SATP_ASID_SHIFT)
+#define SATP_ASID(asid) (((unsigned long)(asid)) << SATP_ASID_SHIFT)
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void 
@@ -256,6 +275,30 @@ r_mcounteren()
   return x;
 }
 
+// Machine Environment Configuration Register
+#define MENVCFG_CBZE (1L << 7) // allow cbo.zero below machine mode
+
+static inline unsigned long
+r_menvcfg()
+{
+  unsigned long x;
+  __asm__ volatile("csrr %0, 0x30a" : "=r" (x) );
+  return x;
+}
+
+static inline void 
+w_menvcfg(unsigned long x)
+{
+  __asm__ volatile("csrw 0x30a, %0" : : "r" (x));
+}
+
+// zero the cache block holding addr (Zicboz cbo.zero)
+static inline void
+cbo_zero(void *addr)
+{
+  __asm__ volatile(".insn i 0x0F, 2, x0, %0, 4" : : "r" (addr) : "memory");
+}
+
 // machine-mode cycle counter
 static inline unsigned long
 r_time()
@@ -265,6 +308,15 @@ r_time()
   return x;
 }
 
+// cycles executed by this hart
+static inline unsigned long
+r_cycle()
+{
+  unsigned long x;
+  __asm__ volatile("csrr %0, cycle" : "=r" (x) );
+  return x;
+}
+
 // enable device interrupts
 static inline void
 intr_on()
@@ -327,6 +379,20 @@ sfence_vma()
   __asm__ volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries of one address space.
+static inline void
+sfence_vma_asid(unsigned long asid)
+{
+  __asm__ volatile("sfence.vma zero, %0" : : "r" (asid) : "memory");
+}
+
+// flush the TLB entries of one page of an address space.
+static inline void
+sfence_vma_page(unsigned long va, unsigned long asid)
+{
+  __asm__ volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid) : "memory");
+}
+
 #endif // __ASSEMBLER__
 
 #define PGSIZE 4096 // bytes per page
@@ -340,6 +406,12 @@ sfence_vma()
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty
+#define PTE_COW (1L << 8) // RSW: shared copy-on-write, copy before writing
+
+// an invalid PTE holding just this marks a stack guard page, see uvm_clear().
+#define PTE_GUARD PTE_COW
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((unsigned long)pa) >> 12) << 10)
@@ -348,11 +420,26 @@ sfence_vma()
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// an invalid PTE with PTE_SWAP set keeps its page's flags, and the
+// swap slot holding its contents in place of the physical page number.
+#define PTE_SWAP (1L << 9) // RSW: page is in swap
+#define SLOT2PTE(slot) ((((unsigned long)(slot)) << 10) | PTE_SWAP)
+#define PTE2SLOT(pte) ((int)((pte) >> 10))
+
+// the same bit in a valid PTE marks a page write-protected by uffd_wp().
+#define PTE_WP PTE_SWAP
+
+// in a swap PTE, whose dirty bit is otherwise clear, it stands for PTE_WP.
+#define PTE_SWAPWP PTE_D
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
 #define PX(level, va) ((((unsigned long) (va)) >> PXSHIFT(level)) & PXMASK)
 
+// bytes mapped by one leaf PTE at a level: 4K, 2M (megapage), 1G (gigapage).
+#define PXSIZE(level)   (1L << PXSHIFT(level))
+
 // one beyond the highest possible virtual address.
 // MAXVA is actually one bit less than the max allowed by
 // Sv39, to avoid having to sign-extend virtual addresses
@@ -0,0 +1,218 @@
+/* Shared memory segments. shmget() finds or creates the segment with a
+ * given key, shmat() maps it into the caller's address space as a
+ * region of its own (see vma_shm()), and shmdt() unmaps it. Every
+ * process that attaches a segment sees the same pages, so a buffer can
+ * be handed over without copying it.
+ *
+ * A segment's pages are allocated when some process first touches
+ * them, and the segment holds a reference to each. Attached regions are
+ * inherited by fork() and dropped by exec() and exit(); the segment,
+ * key, pages and all, is freed when the last one goes. shmrm() frees a
+ * segment that is not attached, and lets the regions of one that is
+ * keep it without anyone else finding it.
+ */
+
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+struct shm {
+  int key;          /* 0 if the slot is free */
+  int npages;
+  int ref;          /* Regions attached to the segment */
+  int removed;      /* shmrm() was called, the key no longer finds it */
+  int order;        /* pages is a kalloc_pages(order) block */
+  void **pages;     /* 0 for pages not touched yet */
+};
+
+static struct {
+  struct spinlock lock;
+  struct shm seg[NSHM];
+} shm;
+
+void shm_init()
+{
+  initlock(&shm.lock);
+}
+
+/* Returns the id of the segment with key, creating it with room for
+ * size bytes if there is none, or -1 if an existing segment is smaller
+ * than size or no slot or memory is free.
+ */
+int shm_get(int key, unsigned long size)
+{
+  unsigned long npages = PGROUNDUP(size) / PGSIZE;
+  struct shm *s, *free = 0;
+  void **pages;
+  int order;
+
+  if (key <= 0 || npages == 0 || npages > SHMPAGES)
+    return -1;
+
+  for (order = 0; (PGSIZE << order) / sizeof(void *) < npages; order++)
+    ;
+  if (!(pages = kalloc_pages(order)))
+    return -1;
+
+  acquire(&shm.lock);
+  for (s = shm.seg; s < &shm.seg[NSHM]; s++) {
+    if (s->key == key && !s->removed)
+      break;
+    if (!s->key && !free)
+      free = s;
+  }
+
+  if (s == &shm.seg[NSHM]) {
+    if (!(s = free)) {
+      release(&shm.lock);
+      kfree_pages(pages, order);
+      return -1;
+    }
+    s->key = key;
+    s->npages = npages;
+    s->ref = 0;
+    s->removed = 0;
+    s->order = order;
+    s->pages = pages;
+    pages = 0;
+  } else if (s->npages < npages) {
+    s = 0;
+  }
+  release(&shm.lock);
+
+  if (pages)
+    kfree_pages(pages, order);
+
+  return s ? s - shm.seg : -1;
+}
+
+/* Take a reference to segment id for a region being attached, and
+ * return it with its size in bytes, or 0 if id names no segment.
+ */
+struct shm *shm_attach(int id, unsigned long *size)
+{
+  struct shm *s;
+
+  if (id < 0 || id >= NSHM)
+    return 0;
+
+  s = &shm.seg[id];
+  acquire(&shm.lock);
+  if (!s->key || s->removed) {
+    release(&shm.lock);
+    return 0;
+  }
+  s->ref++;
+  *size = (unsigned long)s->npages * PGSIZE;
+  release(&shm.lock);
+
+  return s;
+}
+
+/* Another region refers to s, as fork() copies or munmap() splits one. */
+void shm_dup(struct shm *s)
+{
+  acquire(&shm.lock);
+  s->ref++;
+  release(&shm.lock);
+}
+
+/* Free the pages of a segment whose slot the caller has emptied under
+ * the lock. Pages still mapped somewhere keep their own references.
+ */
+static void shm_free(void **pages, int npages, int order)
+{
+  for (int i = 0; i < npages; i++)
+    if (pages[i])
+      kfree(pages[i]);
+  kfree_pages(pages, order);
+}
+
+/* A region attached to s is gone. The last one frees the segment. */
+void shm_put(struct shm *s)
+{
+  void **pages = 0;
+  int npages = 0, order = 0;
+
+  acquire(&shm.lock);
+  if (--s->ref == 0) {
+    pages = s->pages;
+    npages = s->npages;
+    order = s->order;
+    s->key = 0;
+    s->pages = 0;
+  }
+  release(&shm.lock);
+
+  if (pages)
+    shm_free(pages, npages, order);
+}
+
+/* Remove segment id: shmget() creates a new segment for its key from
+ * now on, and shmat() no longer attaches it. It is freed at once if no
+ * region is attached, else by the last shm_put(). Returns 0, or -1 if
+ * id names no segment or it was removed already.
+ */
+int shm_remove(int id)
+{
+  void **pages = 0;
+  int npages = 0, order = 0;
+  struct shm *s;
+
+  if (id < 0 || id >= NSHM)
+    return -1;
+
+  s = &shm.seg[id];
+  acquire(&shm.lock);
+  if (!s->key || s->removed) {
+    release(&shm.lock);
+    return -1;
+  }
+  if (s->ref > 0) {
+    s->removed = 1;
+  } else {
+    pages = s->pages;
+    npages = s->npages;
+    order = s->order;
+    s->key = 0;
+    s->pages = 0;
+  }
+  release(&shm.lock);
+
+  if (pages)
+    shm_free(pages, npages, order);
+
+  return 0;
+}
+
+/* Returns page i of s with a reference taken for the caller's mapping,
+ * allocating it on first use, or 0 if memory is exhausted. May sleep.
+ */
+void *shm_page(struct shm *s, int i)
+{
+  void *pa, *mem = 0;
+
+  acquire(&shm.lock);
+  if (!s->pages[i]) {
+    release(&shm.lock);
+    if (!(mem = uvm_page(true)))
+      return 0;
+
+    acquire(&shm.lock);
+    if (!s->pages[i]) {
+      s->pages[i] = mem;
+      mem = 0;
+    }
+  }
+  pa = s->pages[i];
+  kpage_ref(pa);
+  release(&shm.lock);
+
+  /* Someone else got there first while we were allocating. */
+  if (mem)
+    kfree(mem);
+
+  return pa;
+}
@@ -0,0 +1,251 @@
+/* Object caches for small kernel objects.
+ *
+ * A cache hands out objects of one size, carved out of whole pages
+ * (slabs) from kalloc(). Each slab starts with a header that links it
+ * into its cache and holds the slab's own free list, so an object's
+ * cache is found from its page. A slab goes back to kalloc() as soon as
+ * none of its objects are in use.
+ *
+ * Each hart keeps a magazine, a small stack of free objects, per cache.
+ * Allocation and free only take the cache lock when the magazine is
+ * empty or full, and then move half a magazine at a time.
+ *
+ * kmalloc() serves variable-sized requests from power-of-two caches,
+ * and from whole pages for anything larger than the biggest cache.
+ */
+
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "memstat.h"
+
+#define NCACHE      16    /* Maximum number of caches */
+#define MAGSIZE     8     /* Objects per magazine */
+#define KMALLOC_MIN 16    /* Smallest kmalloc() size class */
+#define KMALLOC_MAX 1024  /* Largest; bigger requests get a page */
+
+struct object {
+  struct object *next;
+};
+
+struct slab {
+  struct slab *next;        /* Doubly linked partial list of the cache */
+  struct slab *prev;
+  struct kmem_cache *cache;
+  struct object *free;
+  int inuse;
+};
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+} __attribute__((aligned(64)));
+
+struct kmem_cache {
+  char *name;
+  int size;
+  int perslab;
+  struct spinlock lock;
+  struct slab partial;      /* List head: slabs with free objects */
+  unsigned long nslabs;
+  struct magazine mag[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  int n;
+  struct kmem_cache cache[NCACHE];
+} slabs;
+
+static struct kmem_cache *kmalloc_cache[8]; /* 16, 32, ..., 1024 bytes */
+
+/* Create a cache for objects of size bytes. Never fails: a kernel with
+ * too many caches is a build-time mistake.
+ */
+struct kmem_cache *kmem_cache_create(char *name, int size)
+{
+  struct kmem_cache *c;
+
+  if ((unsigned long)size > PGSIZE - sizeof(struct slab))
+    panic("kmem_cache_create: object too large");
+
+  acquire(&slabs.lock);
+  if (slabs.n == NCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  c->name = name;
+  c->size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  c->perslab = (PGSIZE - sizeof(struct slab)) / c->size;
+  c->partial.next = c->partial.prev = &c->partial;
+  initlock(&c->lock);
+
+  return c;
+}
+
+void slab_init()
+{
+  initlock(&slabs.lock);
+
+  for (int i = 0, size = KMALLOC_MIN; size <= KMALLOC_MAX; i++, size *= 2)
+    kmalloc_cache[i] = kmem_cache_create("kmalloc", size);
+}
+
+/* Carve a new page into free objects. Called with c->lock held. */
+static struct slab *slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *o;
+
+  if (!(s = kalloc()))
+    return 0;
+
+  s->cache = c;
+  for (int i = c->perslab - 1; i >= 0; i--) {
+    o = (char *)(s + 1) + i * c->size;
+    ((struct object *)o)->next = s->free;
+    s->free = (struct object *)o;
+  }
+
+  s->next = c->partial.next;
+  s->prev = &c->partial;
+  c->partial.next->prev = s;
+  c->partial.next = s;
+  c->nslabs++;
+
+  return s;
+}
+
+/* Move up to n objects from the slabs into magazine m. Called with c->lock held. */
+static void mag_refill(struct kmem_cache *c, struct magazine *m, int n)
+{
+  struct slab *s;
+
+  while (n-- > 0) {
+    if ((s = c->partial.next) == &c->partial && !(s = slab_grow(c)))
+      return;
+
+    m->obj[m->n++] = s->free;
+    s->free = s->free->next;
+    if (++s->inuse == c->perslab) {
+      /* Full slabs are not on any list */
+      s->prev->next = s->next;
+      s->next->prev = s->prev;
+    }
+  }
+}
+
+/* Move n objects from magazine m back to their slabs. Called with c->lock held. */
+static void mag_flush(struct kmem_cache *c, struct magazine *m, int n)
+{
+  struct object *o;
+  struct slab *s;
+
+  while (n-- > 0 && m->n > 0) {
+    o = m->obj[--m->n];
+    s = (struct slab *)PGROUNDDOWN((unsigned long)o);
+    if (s->inuse-- == c->perslab) {
+      s->next = c->partial.next;
+      s->prev = &c->partial;
+      c->partial.next->prev = s;
+      c->partial.next = s;
+    }
+    o->next = s->free;
+    s->free = o;
+
+    if (s->inuse == 0) {
+      s->prev->next = s->next;
+      s->next->prev = s->prev;
+      c->nslabs--;
+      kfree(s);
+    }
+  }
+}
+
+/* Returns a zeroed object from cache c, or 0 if memory is exhausted */
+void *kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj = 0;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if (m->n == 0) {
+    acquire(&c->lock);
+    mag_refill(c, m, MAGSIZE / 2);
+    release(&c->lock);
+  }
+  if (m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+
+  if (obj)
+    memset(obj, 0, c->size);
+
+  return obj;
+}
+
+/* Give an object back to the cache it came from. */
+void kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  if (((struct slab *)PGROUNDDOWN((unsigned long)obj))->cache != c)
+    panic("kmem_cache_free: wrong cache");
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if (m->n == MAGSIZE) {
+    acquire(&c->lock);
+    mag_flush(c, m, MAGSIZE / 2);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  pop_off();
+}
+
+/* Returns n zeroed bytes, or 0 if n is larger than a page or memory is exhausted */
+void *kmalloc(int n)
+{
+  int i, size;
+
+  if (n > KMALLOC_MAX)
+    return n <= PGSIZE ? kalloc() : 0;
+
+  for (i = 0, size = KMALLOC_MIN; size < n; i++, size *= 2)
+    ;
+
+  return kmem_cache_alloc(kmalloc_cache[i]);
+}
+
+/* Free memory from kmalloc(). Slab objects never start on a page boundary,
+ * because of the slab header, so a page-aligned pointer is a whole page.
+ */
+void kmfree(void *p)
+{
+  if ((unsigned long)p % PGSIZE == 0)
+    kfree(p);
+  else
+    kmem_cache_free(((struct slab *)PGROUNDDOWN((unsigned long)p))->cache, p);
+}
+
+/* Fill in the slab fields of a memstat snapshot. */
+void slab_stats(struct memstat *ms)
+{
+  struct kmem_cache *c;
+  int n;
+
+  acquire(&slabs.lock);
+  n = slabs.n;
+  release(&slabs.lock);
+
+  ms->slabpages = 0;
+  for (c = slabs.cache; c < &slabs.cache[n]; c++) {
+    acquire(&c->lock);
+    ms->slabpages += c->nslabs;
+    release(&c->lock);
+  }
+}
@@ -13,12 +13,23 @@ unsigned long timer_scratch[NCPU][5];
 /* assembly code in kernelvec.S for timer interrupt. */
 extern void timervec();
 
-/* entry.S jumps here in machine mode on stack0. */
-void start()
+/* Set if the harts implement Zicboz (cbo.zero). */
+int zicboz;
+
+/* Physical address of the device tree, for fdt_init(). */
+unsigned long boot_fdt;
+
+/* entry.S jumps here in machine mode on stack0, with the hart id and
+ * the device tree address that QEMU passes in a0 and a1.
+ */
+void start(unsigned long hartid, unsigned long fdt)
 {
-  int id = r_mhartid(), interval = 1000000;
+  int id = hartid, interval = 1000000;
   unsigned long *scratch = &timer_scratch[id][0];
 
+  if (id == 0)
+    boot_fdt = fdt;
+
   /* Set Previous Privilege mode to Supervisor, so that we will
    * return into supervisor mode */
   w_mstatus((r_mstatus() & ~MSTATUS_MPP_MASK) | MSTATUS_MPP_S);
@@ -37,6 +48,19 @@ void start()
   w_pmpaddr0(0x3fffffffffffffull);
   w_pmpcfg0(0xf);
 
+  /* Let supervisor mode read the cycle and time CSRs, for boot timing. */
+  w_mcounteren(r_mcounteren() | 3);
+
+#ifdef RVV
+  /* Turn on the vector unit, if the hart has one; string_init() checks. */
+  w_mstatus(r_mstatus() | MSTATUS_VS_INITIAL);
+#endif
+
+  /* Let supervisor mode zero pages with cbo.zero. CBZE stays 0 on harts
+   * without Zicboz, which tells kalloc_init() not to use it. */
+  w_menvcfg(r_menvcfg() | MENVCFG_CBZE);
+  zicboz = (r_menvcfg() & MENVCFG_CBZE) != 0;
+
   /* Arrange to receive timer interrupts. They will arrive in machine mode at
    * timervec in kernelvec.S, which turns them into software interrupts for
    * devintr() in trap.c. */
@@ -1,11 +1,60 @@
+#include "param.h"
+#include "riscv.h"
+#include "defs.h"
+
+// The memory and string routines move a 64-bit word at a time once
+// both pointers are word aligned, and a byte at a time otherwise:
+// a misaligned load or store may trap, and nothing here handles it.
+
+typedef unsigned long __attribute__((may_alias)) word;
+
+#define WORD  sizeof(word)
+#define ONES  0x0101010101010101UL
+#define HIGHS 0x8080808080808080UL
+
+// Nonzero if some byte of w is zero.
+#define HASZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
+#define ALIGNED(p) ((unsigned long)(p) % WORD == 0)
+#define COALIGNED(p, q) ((unsigned long)(p) % WORD == (unsigned long)(q) % WORD)
+
+#ifdef RVV
+// vstring.S. The kernel does not save vector registers across
+// context switches, so callers keep interrupts off.
+void *vmemset(void*, int, unsigned int);
+void *vmemcpy(void*, const void*, unsigned int);
+int vmemcmp(const void*, const void*, unsigned int);
+int vstrlen(const char*);
+
+#define VECTOR_MIN 64  // shorter calls are not worth push_off()
+
+static int vector;  // set by string_init() if the hart has a vector unit
+#endif
+
 void*
 memset(void *dst, int c, unsigned int n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for (i = 0; i < n; i++) {
-    cdst[i] = c;
+  word w;
+
+#ifdef RVV
+  if (vector && n >= VECTOR_MIN) {
+    push_off();
+    vmemset(dst, c, n);
+    pop_off();
+    return dst;
   }
+#endif
+
+  for (; n > 0 && !ALIGNED(cdst); n--)
+    *cdst++ = c;
+  if (n >= WORD) {
+    w = (unsigned char)c * ONES;
+    for (; n >= WORD; n -= WORD, cdst += WORD)
+      *(word *)cdst = w;
+  }
+  while (n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -16,6 +65,25 @@ memcmp(const void *v1, const void *v2, unsigned int n)
 
   s1 = v1;
   s2 = v2;
+#ifdef RVV
+  if (vector && n >= VECTOR_MIN) {
+    int r;
+
+    push_off();
+    r = vmemcmp(v1, v2, n);
+    pop_off();
+    return r;
+  }
+#endif
+
+  if (COALIGNED(s1, s2)) {
+    for (; n > 0 && !ALIGNED(s1); n--, s1++, s2++)
+      if (*s1 != *s2)
+        return *s1 - *s2;
+    // Skip equal words; the byte loop finds the difference in the first unequal one.
+    for (; n >= WORD && *(word *)s1 == *(word *)s2; n -= WORD)
+      s1 += WORD, s2 += WORD;
+  }
   while (n-- > 0) {
     if (*s1 != *s2)
       return *s1 - *s2;
@@ -33,17 +101,42 @@ memmove(void *dst, const void *src, unsigned int n)
 
   if (n == 0)
     return dst;
-  
+
   s = src;
   d = dst;
   if (s < d && s + n > d) {
     s += n;
     d += n;
+    if (COALIGNED(s, d)) {
+      for (; n > 0 && !ALIGNED(d); n--)
+        *--d = *--s;
+      for (; n >= WORD; n -= WORD) {
+        d -= WORD, s -= WORD;
+        *(word *)d = *(word *)s;
+      }
+    }
     while (n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+#ifdef RVV
+    // Copying forwards in vector-sized chunks is safe even if dst is
+    // just below src: each chunk is loaded before it is stored.
+    if (vector && n >= VECTOR_MIN) {
+      push_off();
+      vmemcpy(dst, src, n);
+      pop_off();
+      return dst;
+    }
+#endif
+    if (COALIGNED(s, d)) {
+      for (; n > 0 && !ALIGNED(d); n--)
+        *d++ = *s++;
+      for (; n >= WORD; n -= WORD, d += WORD, s += WORD)
+        *(word *)d = *(word *)s;
+    }
     while (n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -55,9 +148,18 @@ memcpy(void *dst, const void *src, unsigned int n)
   return memmove(dst, src, n);
 }
 
+// Reading whole aligned words may run past the end of a string,
+// but never off its page.
 int
 strncmp(const char *p, const char *q, unsigned int n)
 {
+  if (COALIGNED(p, q)) {
+    for (; n > 0 && !ALIGNED(p); n--, p++, q++)
+      if (!*p || *p != *q)
+        return (unsigned char)*p - (unsigned char)*q;
+    for (; n >= WORD && *(word *)p == *(word *)q && !HASZERO(*(word *)p); n -= WORD)
+      p += WORD, q += WORD;
+  }
   while (n > 0 && *p && *p == *q)
     n--, p++, q++;
   if (n == 0)
@@ -96,10 +198,101 @@ safestrcpy(char *s, const char *t, int n)
 int
 strlen(const char *s)
 {
-  int n;
+  const char *p = s;
 
-  for (n = 0; s[n]; n++)
+#ifdef RVV
+  if (vector) {
+    int n;
+
+    push_off();
+    n = vstrlen(s);
+    pop_off();
+    return n;
+  }
+#endif
+
+  for (; !ALIGNED(p); p++)
+    if (*p == 0)
+      return p - s;
+  for (; !HASZERO(*(word *)p); p += WORD)
     ;
-  return n;
+  while (*p)
+    p++;
+  return p - s;
+}
+
+#ifdef BOOTSTATS
+#define BENCHSZ   (4 * PGSIZE)
+#define BENCHRUNS 8
+
+static char *bench_names[] = { "memset", "memmove", "memcmp", "strlen", "strncmp" };
+
+// Run each primitive over BENCHSZ bytes and print bytes per cycle.
+// a and b hold the same string of BENCHSZ-1 'x's.
+static void
+string_bench1(char *kind, char *a, char *b)
+{
+  unsigned long start, cycles, h;
+
+  printf("string_init: %s bytes/cycle:", kind);
+  for (int i = 0; i < NELEM(bench_names); i++) {
+    start = r_cycle();
+    for (int j = 0; j < BENCHRUNS; j++) {
+      switch (i) {
+      case 0: memset(b, 'x', BENCHSZ - 1); break;
+      case 1: memmove(b, a, BENCHSZ); break;
+      case 2: memcmp(a, b, BENCHSZ); break;
+      case 3: strlen(a); break;
+      case 4: strncmp(a, b, BENCHSZ); break;
+      }
+    }
+    cycles = r_cycle() - start;
+    h = cycles ? 100UL * BENCHSZ * BENCHRUNS / cycles : 0;
+    printf(" %s %d.%d%d", bench_names[i], (int)(h / 100), (int)(h / 10 % 10), (int)(h % 10));
+  }
+  printf("\n");
 }
 
+// Report how fast the word routines are, and the vector ones
+// if string_init() picked them.
+static void
+string_bench()
+{
+  char *a = kalloc_pages(2), *b = kalloc_pages(2);
+
+  if (!a || !b)
+    panic("string_bench");
+
+  memset(a, 'x', BENCHSZ - 1);
+  a[BENCHSZ - 1] = 0;
+  memmove(b, a, BENCHSZ);
+
+#ifdef RVV
+  int v = vector;
+
+  vector = 0;
+  string_bench1("word", a, b);
+  if ((vector = v))
+    string_bench1("vector", a, b);
+#else
+  string_bench1("word", a, b);
+#endif
+
+  kfree_pages(a, 2);
+  kfree_pages(b, 2);
+}
+#endif
+
+// Pick the vector routines if the hart has a vector unit; with
+// make BOOTSTATS=1, also report how fast each version is. Called
+// on hart 0 once kalloc() works.
+void
+string_init()
+{
+#ifdef RVV
+  vector = (r_sstatus() & SSTATUS_VS) != 0;
+#endif
+#ifdef BOOTSTATS
+  string_bench();
+#endif
+}
@@ -0,0 +1,144 @@
+/* Swap space: page-sized slots in a disk area after the file system.
+ *
+ * When kalloc() runs dry, uvm_page() calls swap_out(), which asks
+ * proc_evict() for a page nobody is using at the moment and writes it to
+ * a free slot. The page's PTE is left invalid, holding the slot number
+ * (PTE_SWAP), and the next fault on it reads the page back in.
+ *
+ * After fork() several PTEs may name one slot; each slot counts them and
+ * is free again when the last one goes. A slot is busy while its page is
+ * still being written, and swap_in() waits for that to finish.
+ */
+
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "fs.h"
+#include "defs.h"
+#include "memstat.h"
+
+#define SLOT_BUSY 0x8000   /* Page still being written out */
+
+static struct {
+  struct spinlock lock;
+  unsigned int start;      /* First disk block of the swap area */
+  int n;                   /* Number of slots */
+  int used;                /* Slots not free */
+  int hint;                /* Where to look for a free slot next */
+  unsigned long pageins;
+  unsigned long pageouts;
+  unsigned short ref[SWAPPAGES]; /* PTEs naming each slot, | SLOT_BUSY */
+} swap;
+
+#define SLOT2BLOCK(s) (swap.start + (s) * (PGSIZE / BSIZE))
+
+/* Called by fsinit() once the super block has been read. */
+void swap_init(struct superblock *sb)
+{
+  initlock(&swap.lock);
+  swap.start = sb->swapstart;
+  swap.n = sb->nswap < SWAPPAGES ? sb->nswap : SWAPPAGES;
+}
+
+/* Find a free slot and mark it busy, with one reference. Returns -1 if swap is full. */
+static int swap_alloc()
+{
+  int s = -1;
+
+  acquire(&swap.lock);
+  for (int i = 0; i < swap.n; i++) {
+    s = (swap.hint + i) % swap.n;
+    if (swap.ref[s] == 0) {
+      swap.ref[s] = 1 | SLOT_BUSY;
+      swap.hint = s + 1;
+      swap.used++;
+      break;
+    }
+    s = -1;
+  }
+  release(&swap.lock);
+
+  return s;
+}
+
+/* The write to slot s is over; wake up anyone waiting to read it. */
+static void swap_done(int s)
+{
+  acquire(&swap.lock);
+  swap.ref[s] &= ~SLOT_BUSY;
+  if (swap.ref[s] == 0)
+    swap.used--;
+  release(&swap.lock);
+  wakeup(&swap.ref[s]);
+}
+
+/* Another PTE names slot s, as fork() shares a swapped-out page. */
+void swap_dup(int s)
+{
+  acquire(&swap.lock);
+  swap.ref[s]++;
+  release(&swap.lock);
+}
+
+/* A PTE naming slot s is gone. */
+void swap_free(int s)
+{
+  acquire(&swap.lock);
+  if ((swap.ref[s] & ~SLOT_BUSY) == 0)
+    panic("swap_free");
+  if (--swap.ref[s] == 0)
+    swap.used--;
+  release(&swap.lock);
+}
+
+/* Read slot s into the page at pa. The caller still holds its reference. */
+void swap_in(int s, void *pa)
+{
+  acquire(&swap.lock);
+  while (swap.ref[s] & SLOT_BUSY)
+    sleep(&swap.ref[s], &swap.lock);
+  swap.pageins++;
+  release(&swap.lock);
+
+  virtio_disk_rw_page(SLOT2BLOCK(s), pa, 0);
+}
+
+/* Free a page of memory by writing one out to swap. Sleeps, so the
+ * caller must hold no spinlocks. Returns -1 if swap is full or no page
+ * can be evicted right now.
+ */
+int swap_out()
+{
+  void *pa;
+  int s;
+
+  if ((s = swap_alloc()) < 0)
+    return -1;
+
+  if (!(pa = proc_evict(s))) {
+    swap_free(s);
+    swap_done(s);
+    return -1;
+  }
+
+  virtio_disk_rw_page(SLOT2BLOCK(s), pa, 1);
+  kfree(pa);
+
+  acquire(&swap.lock);
+  swap.pageouts++;
+  release(&swap.lock);
+  swap_done(s);
+
+  return 0;
+}
+
+/* Fill in the swap fields of a memstat snapshot. */
+void swap_stats(struct memstat *ms)
+{
+  acquire(&swap.lock);
+  ms->pageins = swap.pageins;
+  ms->pageouts = swap.pageouts;
+  ms->swapused = swap.used;
+  release(&swap.lock);
+}
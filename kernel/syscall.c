@@ -102,6 +102,18 @@ extern unsigned long sys_readcount();
 extern unsigned long sys_alarm();
 extern unsigned long sys_settickets();
 extern unsigned long sys_getpinfo();
+extern unsigned long sys_memstat();
+extern unsigned long sys_mmap();
+extern unsigned long sys_munmap();
+extern unsigned long sys_shmget();
+extern unsigned long sys_shmat();
+extern unsigned long sys_shmdt();
+extern unsigned long sys_shmrm();
+extern unsigned long sys_uffd();
+extern unsigned long sys_uffd_register();
+extern unsigned long sys_uffd_copy();
+extern unsigned long sys_uffd_zero();
+extern unsigned long sys_uffd_wp();
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -131,6 +143,18 @@ static unsigned long (*syscalls[])() = {
 [SYS_alarm] sys_alarm,
 [SYS_settickets] sys_settickets,
 [SYS_getpinfo] sys_getpinfo,
+[SYS_memstat] sys_memstat,
+[SYS_mmap] sys_mmap,
+[SYS_munmap] sys_munmap,
+[SYS_shmget] sys_shmget,
+[SYS_shmat] sys_shmat,
+[SYS_shmdt] sys_shmdt,
+[SYS_shmrm] sys_shmrm,
+[SYS_uffd] sys_uffd,
+[SYS_uffd_register] sys_uffd_register,
+[SYS_uffd_copy] sys_uffd_copy,
+[SYS_uffd_zero] sys_uffd_zero,
+[SYS_uffd_wp] sys_uffd_wp,
 };
 
 #ifdef SYSCALL_TRACE
@@ -160,6 +184,18 @@ static char *syscall_names[] = {
   "alarm",
   "settickets",
   "getpinfo",
+  "memstat",
+  "mmap",
+  "munmap",
+  "shmget",
+  "shmat",
+  "shmdt",
+  "shmrm",
+  "uffd",
+  "uffd_register",
+  "uffd_copy",
+  "uffd_zero",
+  "uffd_wp",
 };
 #endif
 
@@ -24,3 +24,15 @@
 #define SYS_alarm       23
 #define SYS_settickets  24
 #define SYS_getpinfo    25
+#define SYS_memstat     26
+#define SYS_mmap        27
+#define SYS_munmap      28
+#define SYS_shmget      29
+#define SYS_shmat       30
+#define SYS_shmdt       31
+#define SYS_shmrm       32
+#define SYS_uffd        33
+#define SYS_uffd_register 34
+#define SYS_uffd_copy   35
+#define SYS_uffd_zero   36
+#define SYS_uffd_wp     37
@@ -435,14 +435,18 @@ sys_chdir()
 unsigned long
 sys_exec()
 {
-  char path[MAXPATH], *argv[MAXARG];
-  int i;
+  char path[MAXPATH], *argv[MAXARG], *buf;
+  int i, n;
   unsigned long uargv, uarg;
 
   argaddr(1, &uargv);
   if (argstr(0, path, MAXPATH) < 0) {
     return -1;
   }
+  // Each string is fetched into one scratch page and then copied
+  // into a buffer of its own length.
+  if ((buf = kalloc()) == 0)
+    return -1;
   memset(argv, 0, sizeof(argv));
   for (i=0;; i++) {
     if (i >= NELEM(argv)) {
@@ -455,23 +459,25 @@ sys_exec()
       argv[i] = 0;
       break;
     }
-    argv[i] = kalloc();
-    if (argv[i] == 0)
+    if ((n = fetchstr(uarg, buf, PGSIZE)) < 0)
       goto bad;
-    if (fetchstr(uarg, argv[i], PGSIZE) < 0)
+    if ((argv[i] = kmalloc(n + 1)) == 0)
       goto bad;
+    memmove(argv[i], buf, n + 1);
   }
+  kfree(buf);
 
   int ret = exec(path, argv);
 
   for (i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+    kmfree(argv[i]);
 
   return ret;
 
  bad:
+  kfree(buf);
   for (i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+    kmfree(argv[i]);
   return -1;
 }
 
@@ -504,3 +510,139 @@ sys_pipe()
   }
   return 0;
 }
+
+unsigned long
+sys_mmap()
+{
+  unsigned long addr, len, off;
+  int prot, flags, perm;
+  struct file *f = 0;
+
+  // addr is a hint: if that range is taken, the region goes elsewhere.
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argaddr(5, &off);
+  if (!(flags & MAP_ANONYMOUS) && argfd(4, 0, &f) < 0)
+    return -1;
+
+  if (len == 0 || len > MAXVA || off % PGSIZE != 0)
+    return -1;
+  flags &= ~MAP_ANONYMOUS;
+  if (flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if (f) {
+    if (f->type != FD_INODE || !f->readable)
+      return -1;
+    // Stores to a shared mapping reach the file.
+    if (flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  perm = PTE_R;
+  if (prot & PROT_WRITE)
+    perm |= PTE_W;
+  if (prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  return vma_map(myproc(), f ? f->ip : 0, addr, off, len, perm, flags);
+}
+
+unsigned long
+sys_munmap()
+{
+  unsigned long addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  if (addr % PGSIZE != 0 || addr + len < addr || addr + len > MAXVA)
+    return -1;
+
+  return vma_unmap(myproc(), addr, PGROUNDUP(addr + len));
+}
+
+// Return a new userfaultfd-style descriptor; see uffd.c.
+unsigned long
+sys_uffd()
+{
+  struct file *f;
+  int fd;
+
+  if ((f = uffd_alloc()) == 0)
+    return -1;
+  if ((fd = fdalloc(f)) < 0) {
+    file_close(f);
+    return -1;
+  }
+  return fd;
+}
+
+// Fetch argument n as a uffd() descriptor.
+static int
+arguffd(int n, struct uffd **pu)
+{
+  struct file *f;
+
+  if (argfd(n, 0, &f) < 0 || f->type != FD_UFFD)
+    return -1;
+  *pu = f->uffd;
+  return 0;
+}
+
+unsigned long
+sys_uffd_register()
+{
+  unsigned long addr, len;
+  struct uffd *u;
+  int mode;
+
+  argaddr(1, &addr);
+  argaddr(2, &len);
+  argint(3, &mode);
+  if (arguffd(0, &u) < 0)
+    return -1;
+  return uffd_register(u, addr, len, mode);
+}
+
+unsigned long
+sys_uffd_copy()
+{
+  unsigned long dst, src, len;
+  struct uffd *u;
+
+  argaddr(1, &dst);
+  argaddr(2, &src);
+  argaddr(3, &len);
+  if (arguffd(0, &u) < 0)
+    return -1;
+  return uffd_copy(u, dst, src, len);
+}
+
+unsigned long
+sys_uffd_zero()
+{
+  unsigned long dst, len;
+  struct uffd *u;
+
+  argaddr(1, &dst);
+  argaddr(2, &len);
+  if (arguffd(0, &u) < 0)
+    return -1;
+  return uffd_zero(u, dst, len);
+}
+
+unsigned long
+sys_uffd_wp()
+{
+  unsigned long addr, len;
+  struct uffd *u;
+  int protect;
+
+  argaddr(1, &addr);
+  argaddr(2, &len);
+  argint(3, &protect);
+  if (arguffd(0, &u) < 0)
+    return -1;
+  return uffd_wp(u, addr, len, protect);
+}
@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "pstat.h"
+#include "memstat.h"
 
 unsigned long sys_exit()
 {
@@ -128,13 +129,78 @@ unsigned long sys_settickets(int number)
 	return 0;
 }
 
-unsigned long sys_getpinfo(struct pstat *ps)
+unsigned long sys_getpinfo()
 {
 	unsigned long p;
+
 	argaddr(0, &p);
+	return procinfo(p);
+}
 
-	ps = (struct pstat *)p;
-	procinfo(ps);
+// copy a snapshot of the physical memory statistics to the user
+unsigned long sys_memstat()
+{
+	struct memstat ms;
+	unsigned long addr;
+
+	argaddr(0, &addr);
+	kalloc_stats(&ms);
+	slab_stats(&ms);
+	swap_stats(&ms);
+	uvm_stats(&ms);
+	if (copy_to_user(myproc()->pagetable, addr, (char *)&ms, sizeof(ms)) < 0)
+		return -1;
 
 	return 0;
-}
\ No newline at end of file
+}
+
+// find or create the shared memory segment with a key
+unsigned long sys_shmget()
+{
+	unsigned long size;
+	int key;
+
+	argint(0, &key);
+	argaddr(1, &size);
+	return shm_get(key, size);
+}
+
+// attach a shared memory segment at an address, or anywhere if it is 0
+unsigned long sys_shmat()
+{
+	unsigned long addr, size, va;
+	struct shm *s;
+	int id;
+
+	argint(0, &id);
+	argaddr(1, &addr);
+	if (!(s = shm_attach(id, &size)))
+		return -1;
+	if ((va = vma_shm(myproc(), s, addr, size)) == -1)
+		shm_put(s);
+
+	return va;
+}
+
+// remove a shared memory segment, once it is no longer attached
+unsigned long sys_shmrm()
+{
+	int id;
+
+	argint(0, &id);
+	return shm_remove(id);
+}
+
+// detach the shared memory segment attached at an address
+unsigned long sys_shmdt()
+{
+	struct proc *p = myproc();
+	unsigned long addr;
+	struct vma *v;
+
+	argaddr(0, &addr);
+	if (!(v = vma_find(p, addr)) || v->type != VMA_SHM || v->start != addr)
+		return -1;
+
+	return vma_unmap(p, v->start, PGROUNDUP(v->end));
+}
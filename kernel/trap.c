@@ -9,17 +9,53 @@ struct spinlock tickslock;
 struct spinlock readcountlock;
 unsigned int ticks;
 unsigned int readcount;
+int vstate_order;  /* Of the kalloc_pages() that hold a process's vector state */
 
 extern char trampoline[], uservec[], userret[];
 
 /* In kernelvec.S, calls kerneltrap(). */
 void kernelvec();
 
+#ifdef SUM
+/* The exception table, which kernel.ld gathers from usercopy.S: for each
+ * instruction there that loads or stores user memory, where to resume
+ * if the access cannot be made.
+ */
+struct extable {
+  unsigned long insn;
+  unsigned long fixup;
+};
+
+extern struct extable extable[], eextable[];
+
+/* The fixup for the user access at pc, or 0 if pc is not one. */
+static unsigned long extable_fixup(unsigned long pc)
+{
+  for (struct extable *e = extable; e < eextable; e++)
+    if (e->insn == pc)
+      return e->fixup;
+
+  return 0;
+}
+#endif
+
 extern int devintr();
 
 void trap_init()
 {
   initlock(&tickslock);
+
+#ifdef RVV
+  /* Size the vector save area for this VLEN: vl, vtype, vstart and vcsr,
+   * then v0-v31. The V extension caps VLEN at 65536 bits, 256K of
+   * registers. */
+  if (r_sstatus() & SSTATUS_VS) {
+    while ((PGSIZE << vstate_order) < 32 + 32 * r_vlenb())
+      vstate_order++;
+    if (vstate_order > MAXORDER)
+      panic("trap_init: vector registers");
+  }
+#endif
 }
 
 /* Set up to take exceptions and traps while in the kernel. */
@@ -28,10 +64,41 @@ void trap_init_hart()
   w_stvec((unsigned long)kernelvec);
 }
 
+#ifdef RVV
+/* In vstring.S. */
+void vstate_save(void *);
+void vstate_restore(void *);
+
+/* The kernel's string routines use the vector registers as well, so
+ * once a process writes them (sstatus.VS turns Dirty) they are saved on
+ * each trap from user space and put back on each return. trap_init()
+ * sizes the save area for the hart's VLEN.
+ */
+static void vector_save(struct proc *p)
+{
+  if ((r_sstatus() & SSTATUS_VS) != SSTATUS_VS)
+    return;
+
+  if (!p->vstate && !(p->vstate = kalloc_pages(vstate_order))) {
+    setkilled(p);
+    return;
+  }
+  vstate_save(p->vstate);
+}
+
+static void vector_restore(struct proc *p)
+{
+  if (p->vstate)
+    vstate_restore(p->vstate);
+  w_sstatus((r_sstatus() & ~SSTATUS_VS) | SSTATUS_VS_CLEAN);
+}
+#endif
+
 /* Handle an interrupt, exception, or system call from user space. */
 void usertrap()
 {
   struct proc *p = myproc();
+  unsigned long scause = r_scause(), stval = r_stval();
   int which_dev = 0;
 
   if ((r_sstatus() & SSTATUS_SPP) != 0)
@@ -42,8 +109,13 @@ void usertrap()
   
   /* save user PC. */
   p->trapframe->epc = r_sepc();
+
+#ifdef RVV
+  /* Before anything in the kernel touches the vector registers. */
+  vector_save(p);
+#endif
   
-  if (r_scause() == 8) {
+  if (scause == 8) {
     /* System call */
 
     if (killed(p))
@@ -55,6 +127,16 @@ void usertrap()
     intr_on();
 
     syscall();
+  } else if (scause == 12 || scause == 13 || scause == 15) {
+    /* Instruction, load or store page fault on a page that is demand-paged,
+     * lazily allocated, copy-on-write or in swap. Bringing it in may sleep. */
+    intr_on();
+
+    if (uvm_fault(p, stval, scause == 15) < 0) {
+      printf("usertrap(): page fault scause %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, stval);
+      setkilled(p);
+    }
   } else if (!(which_dev = devintr())) {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -64,9 +146,13 @@ void usertrap()
   if (killed(p))
     exit(-1);
 
-  /* Give up the CPU if this is a timer interrupt. */
-  if (which_dev == 2)
+  /* Give up the CPU if this is a timer interrupt, after seeing where
+   * some more of this process's memory lives. */
+  if (which_dev == 2) {
+    if (nnode > 1)
+      uvm_numa(p);
     yield();
+  }
 
   usertrapret();
 }
@@ -75,11 +161,15 @@ void usertrap()
 void usertrapret()
 {
   unsigned long trampoline_userret = TRAMPOLINE + (userret - trampoline),
-      trampoline_uservec = TRAMPOLINE + (uservec - trampoline);
+      trampoline_uservec = TRAMPOLINE + (uservec - trampoline), satp;
   struct proc *p = myproc();
 
   intr_off();
 
+#ifdef RVV
+  vector_restore(p);
+#endif
+
   w_stvec(trampoline_uservec);
 
   /* Set up trapframe values for when the process next traps into the kernel. */
@@ -98,8 +188,12 @@ void usertrapret()
   w_sepc(p->trapframe->epc);
 
   /* Jump to userret, which switches to the user page table,
-     restores user registers, and switches to user mode with sret. */
-  ((void (*)(unsigned long))trampoline_userret)(MAKE_SATP(p->pagetable));
+     restores user registers, and switches to user mode with sret.
+     Without an ASID of its own, the process shares ASID 0 with the
+     kernel and both switches have to flush the TLB. */
+  satp = uvm_satp(p);
+  p->trapframe->kernel_fence = !(satp & SATP_ASID_MASK);
+  ((void (*)(unsigned long, unsigned long))trampoline_userret)(satp, p->trapframe->kernel_fence);
 }
 
 /* Interrupts and exceptions from kernel code go here. */
@@ -107,6 +201,9 @@ void kerneltrap()
 {
   unsigned long sepc = r_sepc(), sstatus = r_sstatus(), scause = r_scause();
   int which_dev = 0;
+#ifdef SUM
+  unsigned long stval = r_stval(), fixup;
+#endif
   
   if (!(sstatus & SSTATUS_SPP))
     panic("kerneltrap: not from supervisor mode");
@@ -114,6 +211,26 @@ void kerneltrap()
   if (intr_get())
     panic("kerneltrap: interrupts enabled");
 
+#ifdef SUM
+  /* Nothing else gets to touch user memory, even if this trap sleeps;
+   * restoring sstatus below gives usercopy.S its SUM back. */
+  w_sstatus(sstatus & ~SSTATUS_SUM);
+
+  if ((scause == 13 || scause == 15) && stval >= UWINDOW && (fixup = extable_fixup(sepc))) {
+    /* A user access in usercopy.S. Bringing the page in may sleep, if
+     * the copy was made with interrupts on. */
+    if (sstatus & SSTATUS_SPIE)
+      intr_on();
+    if (uvm_window_fault(stval, scause == 15) < 0)
+      sepc = fixup;
+    intr_off();
+
+    w_sepc(sepc);
+    w_sstatus(sstatus);
+    return;
+  }
+#endif
+
   if (!(which_dev = devintr())) {
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -121,8 +238,12 @@ void kerneltrap()
   }
 
   /* Give up the CPU if this is a timer interrupt. */
-  if (which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  if (which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING) {
+    /* Kernel code may be using the process's pages: keep swap_out() off them. */
+    myproc()->kpreempt = 1;
     yield();
+    myproc()->kpreempt = 0;
+  }
 
   /* yield() may have caused some traps to occur, so restore trap registers */
   w_sepc(sepc);
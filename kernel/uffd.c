@@ -0,0 +1,416 @@
+/* Page faults handled in user space, after Linux's userfaultfd.
+ *
+ * uffd() returns a file descriptor, and uffd_register() hands it the
+ * faults in one of the caller's private anonymous mmap() regions: first
+ * touches of pages that are not mapped yet (UFFD_MISSING), stores to
+ * pages that uffd_wp() protected (UFFD_WP), or both. The faulting
+ * process queues a struct uffd_msg and sleeps. A handler, usually
+ * another process that inherited the descriptor, read()s the message
+ * and resolves the fault with uffd_copy(), uffd_zero() or by lifting
+ * the protection with uffd_wp().
+ *
+ * A process only ever changes its own page table. When the owner, the
+ * process that created the descriptor, resolves a page, it is mapped at
+ * once. When a handler does, the resolution is left in the queue entry
+ * and the owner maps it when it wakes up; a page resolved before anyone
+ * touched it waits there for its fault. Such early resolutions may take
+ * only part of the queue, so that a handler cannot fill it and leave no
+ * room for the owner's faults.
+ *
+ * fork() does not pass registrations on. Once the descriptor is closed,
+ * faults in its regions are handled as if they were never registered.
+ */
+
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "defs.h"
+#include "uffd.h"
+
+#define UFFD_QUEUE 16  /* Faults and early resolutions pending per descriptor */
+#define UFFD_EARLY 8   /* Early resolutions, at most */
+
+enum { UFFD_COPY = 1, UFFD_ZERO, UFFD_WAKE };
+
+struct uffd_fault {
+  enum { FAULT_FREE, FAULT_QUEUED, FAULT_READ, FAULT_RESOLVED, FAULT_EARLY } state;
+  unsigned long va;   /* Page-aligned */
+  int flags;          /* UFFD_MSG_* */
+  int how;            /* UFFD_COPY, UFFD_ZERO or UFFD_WAKE, once resolved */
+  void *page;         /* The contents, for UFFD_COPY */
+};
+
+struct uffd {
+  struct spinlock lock;
+  int ref;            /* The file, and each region registered with it */
+  int open;           /* The file is not closed yet */
+  int pid;            /* The owner */
+  struct uffd_fault q[UFFD_QUEUE];
+};
+
+/* Returns the entry for page va, or 0. Called with u->lock held. */
+static struct uffd_fault *uffd_lookup(struct uffd *u, unsigned long va)
+{
+  for (struct uffd_fault *f = u->q; f < &u->q[UFFD_QUEUE]; f++)
+    if (f->state != FAULT_FREE && f->va == va)
+      return f;
+
+  return 0;
+}
+
+/* Returns the number of early resolutions in u's queue. Called with
+ * u->lock held.
+ */
+static int uffd_early(struct uffd *u)
+{
+  int n = 0;
+
+  for (struct uffd_fault *f = u->q; f < &u->q[UFFD_QUEUE]; f++)
+    if (f->state == FAULT_EARLY)
+      n++;
+
+  return n;
+}
+
+/* Returns a free entry, or 0. Called with u->lock held. */
+static struct uffd_fault *uffd_slot(struct uffd *u)
+{
+  for (struct uffd_fault *f = u->q; f < &u->q[UFFD_QUEUE]; f++)
+    if (f->state == FAULT_FREE)
+      return f;
+
+  return 0;
+}
+
+/* Empty entry f, waking anyone waiting for a free one. Called with u->lock held. */
+static void uffd_free(struct uffd *u, struct uffd_fault *f)
+{
+  if (f->page)
+    kfree(f->page);
+  f->page = 0;
+  f->state = FAULT_FREE;
+  wakeup(u);
+}
+
+/* Create a descriptor owned by the caller, as a file open for reading. */
+struct file *uffd_alloc()
+{
+  struct file *f;
+  struct uffd *u;
+
+  if (!(f = file_alloc()))
+    return 0;
+  if (!(u = kmalloc(sizeof(*u)))) {
+    file_close(f);
+    return 0;
+  }
+
+  memset(u, 0, sizeof(*u));
+  initlock(&u->lock);
+  u->ref = 1;
+  u->open = 1;
+  u->pid = myproc()->pid;
+
+  f->type = FD_UFFD;
+  f->readable = 1;
+  f->writable = 0;
+  f->uffd = u;
+  return f;
+}
+
+/* Another region is registered with u, as munmap() splits one. */
+void uffd_dup(struct uffd *u)
+{
+  acquire(&u->lock);
+  u->ref++;
+  release(&u->lock);
+}
+
+/* The file or a region registered with u is gone. The last one frees u. */
+void uffd_put(struct uffd *u)
+{
+  acquire(&u->lock);
+  if (--u->ref > 0) {
+    release(&u->lock);
+    return;
+  }
+  for (struct uffd_fault *f = u->q; f < &u->q[UFFD_QUEUE]; f++)
+    if (f->page)
+      kfree(f->page);
+  release(&u->lock);
+
+  kmfree(u);
+}
+
+/* The file is closed: wake the owner and handlers, and let faults in the
+ * registered regions take their usual course from now on.
+ */
+void uffd_close(struct uffd *u)
+{
+  acquire(&u->lock);
+  u->open = 0;
+  for (struct uffd_fault *f = u->q; f < &u->q[UFFD_QUEUE]; f++)
+    wakeup(f);
+  wakeup(u);
+  wakeup(&u->q);
+  release(&u->lock);
+
+  uffd_put(u);
+}
+
+/* Hand the faults in p's region [addr, addr+len) of kind mode to u. The
+ * range must be a whole private anonymous region, and p u's owner.
+ */
+int uffd_register(struct uffd *u, unsigned long addr, unsigned long len, int mode)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if (p->pid != u->pid || mode == 0 || (mode & ~(UFFD_MISSING | UFFD_WP)))
+    return -1;
+
+  if (!(v = vma_find(p, addr)) || v->type != VMA_ANON || (v->flags & MAP_SHARED) ||
+      v->start != addr || PGROUNDUP(v->end) != PGROUNDUP(addr + len))
+    return -1;
+
+  if (v->uffd && v->uffd != u)
+    return -1;
+  if (!v->uffd) {
+    uffd_dup(u);
+    v->uffd = u;
+  }
+  v->uffdmode = mode;
+
+  return 0;
+}
+
+/* Queue a fault at va in p's region v and wait for a handler to resolve
+ * it, then map what it provided. Called by p, with no spinlocks held.
+ * Returns 0 if the access can be retried, -1 if p was killed or memory
+ * is exhausted, and 1 if the descriptor was closed and the fault should
+ * be handled as usual.
+ */
+int uffd_fault(struct proc *p, struct vma *v, unsigned long va, int flags)
+{
+  struct uffd *u = v->uffd;
+  struct uffd_fault *f = 0;
+  void *page;
+  int how, r;
+
+  if (!intr_get())
+    return -1;
+
+  va = PGROUNDDOWN(va);
+  acquire(&u->lock);
+  while (u->open && !killed(p)) {
+    if (!f && !(f = uffd_lookup(u, va)) && (f = uffd_slot(u))) {
+      f->state = FAULT_QUEUED;
+      f->va = va;
+      f->flags = flags;
+      wakeup(&u->q);
+    }
+    if (f && f->state == FAULT_EARLY)
+      f->state = FAULT_RESOLVED;
+    if (f && f->state == FAULT_RESOLVED)
+      break;
+    sleep(f ? (void *)f : (void *)u, &u->lock);
+  }
+
+  if (!f || f->state != FAULT_RESOLVED) {
+    r = u->open ? -1 : 1;
+    if (f)
+      uffd_free(u, f);
+    release(&u->lock);
+    return r;
+  }
+
+  how = f->how;
+  page = f->page;
+  f->page = 0;
+  uffd_free(u, f);
+  release(&u->lock);
+
+  p->majflt++;
+
+  /* A protected page is there already; any answer lifts the protection. */
+  if (flags & UFFD_MSG_WP) {
+    if (page)
+      kfree(page);
+    uvm_protect(p->pagetable, va, va + PGSIZE, false);
+    return 0;
+  }
+
+  if (how == UFFD_COPY && uvm_mappage(p->pagetable, va, (unsigned long)page, v->perm | PTE_U) < 0) {
+    kfree(page);
+    return -1;
+  }
+  if (how == UFFD_ZERO && uvm_mapzero(p->pagetable, va, v->perm) < 0)
+    return -1;
+
+  /* For UFFD_WAKE nothing is mapped, and the access faults again. */
+  return 0;
+}
+
+/* Read the next fault waiting for a handler into the struct uffd_msg at
+ * user address addr. Sleeps until there is one.
+ */
+int uffd_read(struct uffd *u, unsigned long addr, int n)
+{
+  struct uffd_fault *f;
+  struct uffd_msg m;
+
+  if (n < sizeof(m))
+    return -1;
+
+  acquire(&u->lock);
+  for (;;) {
+    for (f = u->q; f < &u->q[UFFD_QUEUE] && f->state != FAULT_QUEUED; f++)
+      ;
+    if (f < &u->q[UFFD_QUEUE])
+      break;
+    if (killed(myproc())) {
+      release(&u->lock);
+      return -1;
+    }
+    sleep(&u->q, &u->lock);
+  }
+  f->state = FAULT_READ;
+  m.addr = f->va;
+  m.flags = f->flags;
+  release(&u->lock);
+
+  if (copy_to_user(myproc()->pagetable, addr, (char *)&m, sizeof(m)) < 0) {
+    /* Leave the fault for the next read. */
+    acquire(&u->lock);
+    if (f->state == FAULT_READ && f->va == m.addr)
+      f->state = FAULT_QUEUED;
+    release(&u->lock);
+    return -1;
+  }
+
+  return sizeof(m);
+}
+
+/* Resolve page va of u's owner: the owner maps it at once, anyone else
+ * answers the owner's pending fault there, or leaves the answer for the
+ * fault to come. Takes over page. Returns -1 if the page is mapped
+ * already, outside u's regions, resolved already, or there is no room
+ * for an early resolution.
+ */
+static int uffd_resolve(struct uffd *u, unsigned long va, int how, void *page)
+{
+  struct proc *p = myproc();
+  struct uffd_fault *f;
+  unsigned long *pte;
+  struct vma *v;
+  int r = 0;
+
+  if (p->pid == u->pid) {
+    if (!(v = vma_find(p, va)) || v->uffd != u)
+      r = -1;
+    else if (how == UFFD_WAKE)
+      uvm_protect(p->pagetable, va, va + PGSIZE, false);
+    else if ((pte = walk(p->pagetable, va, 0)) && (*pte & (PTE_V | PTE_SWAP)))
+      r = -1;
+    else if (how == UFFD_COPY && (r = uvm_mappage(p->pagetable, va, (unsigned long)page, v->perm | PTE_U)) == 0)
+      page = 0;
+    else if (how == UFFD_ZERO)
+      r = uvm_mapzero(p->pagetable, va, v->perm);
+    if (page)
+      kfree(page);
+    return r;
+  }
+
+  acquire(&u->lock);
+  if ((f = uffd_lookup(u, va)) && (f->state == FAULT_QUEUED || f->state == FAULT_READ)) {
+    f->state = FAULT_RESOLVED;
+    f->how = how;
+    f->page = page;
+    wakeup(f);
+  } else if (!f && how != UFFD_WAKE && uffd_early(u) < UFFD_EARLY && (f = uffd_slot(u))) {
+    f->state = FAULT_EARLY;
+    f->va = va;
+    f->flags = 0;
+    f->how = how;
+    f->page = page;
+  } else if (how != UFFD_WAKE) {
+    r = -1;
+    if (page)
+      kfree(page);
+  }
+  release(&u->lock);
+
+  return r;
+}
+
+/* Resolve the pages of [dst, dst+len) with copies of the caller's pages
+ * at src.
+ */
+int uffd_copy(struct uffd *u, unsigned long dst, unsigned long src, unsigned long len)
+{
+  void *mem;
+
+  if (dst % PGSIZE != 0 || len % PGSIZE != 0 || dst + len < dst || dst + len > MAXVA)
+    return -1;
+
+  for (unsigned long i = 0; i < len; i += PGSIZE) {
+    if (!(mem = uvm_page(false)))
+      return -1;
+    if (copy_from_user(myproc()->pagetable, mem, src + i, PGSIZE) < 0) {
+      kfree(mem);
+      return -1;
+    }
+    if (uffd_resolve(u, dst + i, UFFD_COPY, mem) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Resolve the pages of [dst, dst+len) with zeroes. */
+int uffd_zero(struct uffd *u, unsigned long dst, unsigned long len)
+{
+  if (dst % PGSIZE != 0 || len % PGSIZE != 0 || dst + len < dst || dst + len > MAXVA)
+    return -1;
+
+  for (unsigned long i = 0; i < len; i += PGSIZE)
+    if (uffd_resolve(u, dst + i, UFFD_ZERO, 0) < 0)
+      return -1;
+
+  return 0;
+}
+
+/* Write-protect the present pages of [addr, addr+len), which only the
+ * owner can do, to its UFFD_WP regions; or lift the protection, which
+ * for anyone but the owner means answering the owner's pending faults.
+ */
+int uffd_wp(struct uffd *u, unsigned long addr, unsigned long len, int protect)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if (addr % PGSIZE != 0 || len % PGSIZE != 0 || addr + len < addr || addr + len > MAXVA)
+    return -1;
+
+  if (protect) {
+    if (p->pid != u->pid)
+      return -1;
+    for (unsigned long va = addr; va < addr + len; va += PGSIZE)
+      if (!(v = vma_find(p, va)) || v->uffd != u || !(v->uffdmode & UFFD_WP))
+        return -1;
+    uvm_protect(p->pagetable, addr, addr + len, true);
+    return 0;
+  }
+
+  for (unsigned long i = 0; i < len; i += PGSIZE)
+    if (uffd_resolve(u, addr + i, UFFD_WAKE, 0) < 0)
+      return -1;
+
+  return 0;
+}
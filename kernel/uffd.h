@@ -0,0 +1,14 @@
+// User-space page fault handling, see uffd.c.
+
+// uffd_register() modes
+#define UFFD_MISSING 0x1  // first touch of a page not mapped yet
+#define UFFD_WP      0x2  // store to a page protected by uffd_wp()
+
+// A fault, as read() from a uffd() descriptor.
+struct uffd_msg {
+  unsigned long addr;  // page-aligned faulting address
+  int flags;           // UFFD_MSG_*
+};
+
+#define UFFD_MSG_WRITE 0x1  // the access was a store
+#define UFFD_MSG_WP    0x2  // to a write-protected page
@@ -45,7 +45,7 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    int *busy;   // cleared by virtio_disk_intr() when the request is done
     char status;
   } info[NUM];
 
@@ -208,11 +208,11 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// read or write len bytes at data, starting at sector.
+// *busy is set while the device owns data.
+static void
+virtio_disk_io(unsigned long sector, void *data, unsigned int len, int write, int *busy)
 {
-  unsigned long sector = b->blockno * (BSIZE / 512);
-
   acquire(&disk.vdisk_lock);
 
   // the spec's Section 5.2 says that legacy block operations use
@@ -245,8 +245,8 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (unsigned long) b->data;
-  disk.desc[idx[1]].len = BSIZE;
+  disk.desc[idx[1]].addr = (unsigned long) data;
+  disk.desc[idx[1]].len = len;
   if (write)
     disk.desc[idx[1]].flags = 0; // device reads b->data
   else
@@ -260,9 +260,9 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
   disk.desc[idx[2]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the request for virtio_disk_intr().
+  *busy = 1;
+  disk.info[idx[0]].busy = busy;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -277,16 +277,32 @@ virtio_disk_rw(struct buf *b, int write)
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
   // Wait for virtio_disk_intr() to say request has finished.
-  while (b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  while (*busy) {
+    sleep(busy, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
+  disk.info[idx[0]].busy = 0;
   free_chain(idx[0]);
 
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_io(b->blockno * (BSIZE / 512), b->data, BSIZE, write, &b->disk);
+}
+
+// read or write the page at pa, starting at block blockno,
+// without going through the buffer cache.
+void
+virtio_disk_rw_page(unsigned int blockno, void *pa, int write)
+{
+  int busy;
+
+  virtio_disk_io((unsigned long)blockno * (BSIZE / 512), pa, PGSIZE, write, &busy);
+}
+
 void
 virtio_disk_intr()
 {
@@ -312,9 +328,9 @@ virtio_disk_intr()
     if (disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    int *busy = disk.info[id].busy;
+    *busy = 0;   // disk is done with the request's data
+    wakeup(busy);
 
     disk.used_idx += 1;
   }
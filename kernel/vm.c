@@ -1,15 +1,59 @@
 /* Manages page tables and address spaces
  */
 
+#include "param.h"
 #include "memlayout.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
+#include "fcntl.h"
+#include "memstat.h"
+#include "uffd.h"
 
 unsigned long * kernel_pagetable; /* Pointer to the kernel's root page-table page*/
 
 extern char etext[];  /* kernel.ld sets this to end of kernel code. */
 extern char trampoline[];
 
+/* Leaf PTEs of each size installed by kvm_map(), for the boot report. */
+static unsigned long kvm_leaves[3];
+
+/* Mapped copy-on-write wherever anonymous memory is read before it is
+ * written. The kernel's own reference keeps it from ever being freed.
+ */
+static void *zeropage;
+
+/* Kernel stacks are mapped and unmapped while the kernel runs. Each
+ * change bumps gen; a hart fences its TLB in kvm_sync() before it
+ * switches to a process whose stack may be newer than its last fence.
+ */
+static struct {
+  struct spinlock lock;
+  unsigned long gen;
+} kstacks;
+
+/* Address space identifiers. Each process gets an ASID to tag its TLB
+ * entries, so they survive traps into the kernel (which keeps ASID 0)
+ * and switches to other processes. ASIDs are handed out in order; once
+ * they run out a new generation starts, every hart flushes its whole TLB
+ * once, and processes pick up fresh ASIDs as they next return to user
+ * space. A hart without ASIDs runs everything under ASID 0 and flushes on
+ * every switch, as before.
+ */
+static struct {
+  struct spinlock lock;
+  unsigned long max;  /* Largest ASID the harts implement, 0 if none */
+  unsigned long next;
+  unsigned long gen;
+} asids = { .next = 1, .gen = 1 };
+
+#ifdef SUM
+/* In usercopy.S. */
+int user_copy(void *dst, const void *src, unsigned long n);
+int user_copystr(char *dst, const char *src, unsigned long max);
+#endif
+
 /* Make a direct-map page table for the kernel. */
 static unsigned long * kvm_make()
 {
@@ -19,19 +63,47 @@ static unsigned long * kvm_make()
   kvm_map(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
   kvm_map(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
   kvm_map(kpgtbl, KERNBASE, KERNBASE, (unsigned long)etext-KERNBASE, PTE_R | PTE_X);
-  kvm_map(kpgtbl, (unsigned long)etext, (unsigned long)etext, PHYSTOP-(unsigned long)etext, PTE_R | PTE_W);
+  kvm_map(kpgtbl, (unsigned long)etext, (unsigned long)etext, phystop-(unsigned long)etext, PTE_R | PTE_W);
   kvm_map(kpgtbl, TRAMPOLINE, (unsigned long)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  /* Allocate and map a kernel stack for each process. */
-  proc_mapstacks(kpgtbl);
-  
   return kpgtbl;
 }
 
+#ifdef BOOTSTATS
+/* Count the page-table pages below (and including) a page-table page. */
+static int kvm_count(unsigned long * pagetable)
+{
+  int n = 1;
+
+  for (int i = 0; i < 512; i++)
+    if ((pagetable[i] & PTE_V) && !(pagetable[i] & (PTE_R|PTE_W|PTE_X)))
+      n += kvm_count((unsigned long *)PTE2PA(pagetable[i]));
+
+  return n;
+}
+#endif
+
 /* Initialize the one kernel pagetable */
 void kvm_init()
 {
+#ifdef BOOTSTATS
+  unsigned long start = r_time();
+#endif
+
   kernel_pagetable = kvm_make();
+  if (!(zeropage = kalloc()))
+    panic("kvm_init: zero page");
+  initlock(&asids.lock);
+  initlock(&kstacks.lock);
+
+#ifdef BOOTSTATS
+  /* Each megapage leaf saves a level-0 page-table page, each gigapage
+   * leaf a level-1 page and the 512 level-0 pages below it.
+   */
+  printf("kvm_init: %d page-table pages, %d saved by %d megapages and %d gigapages, %d mtime ticks\n",
+         kvm_count(kernel_pagetable), (int)(kvm_leaves[1] + 513*kvm_leaves[2]),
+         (int)kvm_leaves[1], (int)kvm_leaves[2], (int)(r_time() - start));
+#endif
 }
 
 /* Switch HW page table register to the kernel's page table,
@@ -39,17 +111,151 @@ void kvm_init()
  */
 void kvm_init_hart()
 {
+  unsigned long *root = kernel_pagetable;
+
+#ifdef SUM
+  /* A root of its own, whose upper half is the user window. */
+  if (!(root = kalloc()))
+    panic("kvm_init_hart");
+  memmove(root, kernel_pagetable, PGSIZE / 2);
+  memset(root + 256, 0, PGSIZE / 2);
+  mycpu()->kpagetable = root;
+#endif
+
   /* Wait for any previous writes to the page table memory to finish. */
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  w_satp(MAKE_SATP(root));
 
   /* Flush stale entries from the TLB. */
   sfence_vma();
+
+  /* ASID bits the hart does not implement read back as zero. */
+  if (cpuid() == 0) {
+    w_satp(MAKE_SATP(root) | SATP_ASID_MASK);
+    asids.max = (r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+    w_satp(MAKE_SATP(root));
+    sfence_vma();
+#ifdef BOOTSTATS
+    printf("kvm_init_hart: %d ASIDs\n", (int)asids.max);
+#endif
+  }
+}
+
+/* Allocate a kernel stack page and map it at va. The page below va
+ * stays unmapped as a guard. Returns 0 if memory is exhausted.
+ */
+unsigned long kvm_stack_alloc(unsigned long va)
+{
+  char *pa;
+
+  if (!(pa = kalloc()))
+    return 0;
+
+  acquire(&kstacks.lock);
+  if (mappages(kernel_pagetable, va, PGSIZE, (unsigned long)pa, PTE_R | PTE_W) < 0) {
+    release(&kstacks.lock);
+    kfree(pa);
+    return 0;
+  }
+  kstacks.gen++;
+  release(&kstacks.lock);
+
+  return va;
+}
+
+/* Unmap and free the kernel stack at va. Its process must never run again. */
+void kvm_stack_free(unsigned long va)
+{
+  acquire(&kstacks.lock);
+  uvm_unmap(kernel_pagetable, va, 1, 1);
+  kstacks.gen++;
+  release(&kstacks.lock);
+}
+
+/* Bring this hart's TLB up to date with the kernel stack mappings. */
+void kvm_sync()
+{
+  struct cpu *c = mycpu();
+  unsigned long gen = __atomic_load_n(&kstacks.gen, __ATOMIC_ACQUIRE);
+
+  if (c->kstack_gen != gen) {
+    sfence_vma_asid(0);
+    c->kstack_gen = gen;
+  }
+}
+
+/* Pick the satp value process p returns to user space with, giving it a
+ * fresh ASID if its old one belongs to an earlier generation, and fence
+ * this hart's TLB of anything stale under that ASID. Called with
+ * interrupts off.
+ */
+unsigned long uvm_satp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  unsigned long gen;
+
+  if (asids.max == 0)
+    return MAKE_SATP(p->pagetable);
+
+  gen = __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE);
+  if (p->asid_gen != gen) {
+    acquire(&asids.lock);
+    if (asids.next > asids.max) {
+      asids.gen++;
+      asids.next = 1;
+    }
+    p->asid = asids.next++;
+    p->asid_gen = gen = asids.gen;
+    release(&asids.lock);
+    p->tlbdirty = 0;
+  }
+
+  if (c->asid_gen != gen) {
+    /* ASIDs were recycled since this hart last flushed. */
+    sfence_vma();
+    c->asid_gen = gen;
+  } else if (p->tlbdirty || p->last_cpu != cpuid()) {
+    /* Entries left from running here before it migrated or changed its mappings. */
+    sfence_vma_asid(p->asid);
+  }
+  p->tlbdirty = 0;
+  p->last_cpu = cpuid();
+
+  return MAKE_SATP(p->pagetable) | SATP_ASID(p->asid);
 }
 
-/* Find the PTE given a virtual address.  If alloc != 0, create any required
- * page-table pages.
+/* Translations for npages pages at va in pagetable have changed. If they
+ * belong to the current process, fence them out of this hart's TLB: page by
+ * page for a few, or its whole ASID on the way back to user space. Other
+ * harts catch up when the process next migrates to them.
+ */
+static void uvm_flush(unsigned long * pagetable, unsigned long va, unsigned long npages)
+{
+  struct proc *p = myproc();
+
+  if (!p || p->pagetable != pagetable)
+    return;
+
+  if (npages > 16) {
+    p->tlbdirty = 1;
+#ifdef SUM
+    sfence_vma_asid(0);
+#endif
+    return;
+  }
+  for (; npages > 0; npages--, va += PGSIZE) {
+    sfence_vma_page(va, p->asid);
+#ifdef SUM
+    sfence_vma_page(UWINDOW + va, 0);
+#endif
+  }
+}
+
+/* Find the PTE at the given level (0 for a 4K page, 1 for a 2M megapage,
+ * 2 for a 1G gigapage) for a virtual address. If alloc != 0, create any
+ * required page-table pages. Stops early, returning the leaf, if a larger
+ * page already maps va.
  *
  * xv7 uses a 3-level page table scheme, where a page-table page contains
  * 512 64-bit PTEs.
@@ -60,16 +266,19 @@ void kvm_init_hart()
  *   12..20 -- 9 bits of level-0 index.
  *   0..11 -- 12 bits of byte offset within the page.
  */
-static unsigned long * walk(unsigned long * pagetable, unsigned long va, int alloc)
+static unsigned long * walk_level(unsigned long * pagetable, unsigned long va, int alloc, int stop)
 {
   unsigned long *pte;
 
   if (va >= MAXVA)
     panic("walk");
 
-  for (int level = 2; level > 0; level--) {
+  for (int level = 2; level > stop; level--) {
     pte = &pagetable[PX(level, va)];
     if (*pte & PTE_V) {
+      if (*pte & (PTE_R|PTE_W|PTE_X))
+        return pte;
+
       pagetable = (unsigned long *)PTE2PA(*pte);
     } else {
       if (!alloc || !(pagetable = kalloc()))
@@ -79,6 +288,68 @@ static unsigned long * walk(unsigned long * pagetable, unsigned long va, int all
     }
   }
 
+  return &pagetable[PX(stop, va)];
+}
+
+/* Find the PTE of the 4K page holding va. */
+unsigned long * walk(unsigned long * pagetable, unsigned long va, int alloc)
+{
+  return walk_level(pagetable, va, alloc, 0);
+}
+
+/* The level-0 page-table page last used by a range walk. */
+struct ptcursor {
+  unsigned long *table;  /* 0 until the first lookup */
+  unsigned long base;    /* First address that table maps */
+  int level;             /* Level of the PTE last returned: 1 for a megapage */
+};
+
+/* Physical address of the 4K page holding va, mapped by leaf pte at level. */
+#define LEAFPA(pte, level, va) (PTE2PA(pte) + ((va) & (PXSIZE(level) - 1) & ~(PGSIZE - 1)))
+
+#define HUGEORDER 9  /* A megapage is a 2^9-page buddy block */
+
+/* walk() for a run of increasing addresses: while va stays in the 2M
+ * that the cursor's level-0 table maps, the PTE is found without going
+ * through the upper levels. If alloc is 0 and va has no level-0 table,
+ * returns 0 and sets *next past the whole missing subtree, so that a
+ * caller can skip it. A megapage leaf is returned as it is, with
+ * c->level set to 1.
+ */
+static unsigned long * walk_cursor(unsigned long * pagetable, struct ptcursor *c, unsigned long va, int alloc, unsigned long *next)
+{
+  unsigned long *pte;
+
+  c->level = 0;
+  if (c->table && va - c->base < PXSIZE(1))
+    return &c->table[PX(0, va)];
+
+  if (va >= MAXVA)
+    panic("walk");
+
+  for (int level = 2; level > 0; level--) {
+    pte = &pagetable[PX(level, va)];
+    if (*pte & PTE_V) {
+      if (*pte & (PTE_R|PTE_W|PTE_X)) {
+        c->level = level;
+        return pte;
+      }
+
+      pagetable = (unsigned long *)PTE2PA(*pte);
+    } else if (!alloc) {
+      *next = (va & ~(PXSIZE(level) - 1)) + PXSIZE(level);
+      return 0;
+    } else {
+      if (!(pagetable = kalloc()))
+        return 0;
+
+      *pte = PA2PTE(pagetable) | PTE_V;
+    }
+  }
+
+  c->table = pagetable;
+  c->base = va & ~(PXSIZE(1) - 1);
+
   return &pagetable[PX(0, va)];
 }
 
@@ -87,29 +358,51 @@ static unsigned long * walk(unsigned long * pagetable, unsigned long va, int all
  */
 unsigned long walkaddr(unsigned long * pagetable, unsigned long va)
 {
-  unsigned long *pte;
+  unsigned long *pte, next;
+  struct ptcursor c = {0};
 
   if (va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walk_cursor(pagetable, &c, va, 0, &next);
   if (pte == 0 || !(*pte & PTE_V) || !(*pte & PTE_U))
     return 0;
 
-  return PTE2PA(*pte);
+  return LEAFPA(*pte, c.level, va);
 }
 
-/* Add a mapping to the kernel page table. */
+/* Add a mapping to the kernel page table, using the largest leaf pages
+ * that the alignment of va and pa and the remaining size allow.
+ */
 void kvm_map(unsigned long * kpgtbl, unsigned long va, unsigned long pa, unsigned long sz, int perm)
 {
-  if (mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvm_map");
+  unsigned long end = PGROUNDUP(va + sz), *pte;
+  int level;
+
+  va = PGROUNDDOWN(va), pa = PGROUNDDOWN(pa);
+  while (va < end) {
+    for (level = 2; level > 0; level--)
+      if (va % PXSIZE(level) == 0 && pa % PXSIZE(level) == 0 && end - va >= PXSIZE(level))
+        break;
+
+    if (!(pte = walk_level(kpgtbl, va, 1, level)))
+      panic("kvm_map");
+
+    if (*pte & PTE_V)
+      panic("kvm_map: remap");
+
+    *pte = PA2PTE(pa) | perm | PTE_V;
+    kvm_leaves[level]++;
+
+    va += PXSIZE(level), pa += PXSIZE(level);
+  }
 }
 
 /* Add PTEs to the pagetable for va that refers to pa. */
 int mappages(unsigned long * pagetable, unsigned long va, unsigned long size, unsigned long pa, int perm)
 {
   unsigned long a, last, *pte;
+  struct ptcursor c = {0};
 
   if (size == 0)
     panic("mappages: size");
@@ -117,7 +410,7 @@ int mappages(unsigned long * pagetable, unsigned long va, unsigned long size, un
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for (;;) {
-    if (!(pte = walk(pagetable, a, 1)))
+    if (!(pte = walk_cursor(pagetable, &c, a, 1, 0)))
       return -1;
 
     if (*pte & PTE_V)
@@ -133,20 +426,78 @@ int mappages(unsigned long * pagetable, unsigned long va, unsigned long size, un
   return 0;
 }
 
-/* Remove npages of mappings starting from va. */
+/* Keep the current process's count of megapages in step with pagetable. */
+static void uvm_hugecount(unsigned long * pagetable, int n)
+{
+  struct proc *p = myproc();
+
+  if (p && p->pagetable == pagetable)
+    p->hugepages += n;
+}
+
+/* Replace the megapage leaf *pte with a level-0 table mapping the same
+ * 4K pages. The table may be one of the megapage's own pages, if the
+ * caller is about to unmap it; its PTE is then left empty.
+ */
+static void uvm_split(unsigned long * pagetable, unsigned long *pte, unsigned long *table)
+{
+  unsigned long pa = PTE2PA(*pte), flags = PTE_FLAGS(*pte);
+
+  kalloc_split((void *)pa, HUGEORDER);
+  for (int i = 0; i < 512; i++, pa += PGSIZE)
+    table[i] = pa == (unsigned long)table ? 0 : PA2PTE(pa) | flags;
+
+  *pte = PA2PTE(table) | PTE_V;
+  uvm_hugecount(pagetable, -1);
+}
+
+/* Remove npages of mappings starting from va. Pages that were never
+ * touched (lazily allocated heap) have no mapping and are skipped, as
+ * are whole subtrees without a page table. A megapage the range only
+ * partly covers is split first.
+ */
 void uvm_unmap(unsigned long * pagetable, unsigned long va, unsigned long npages, int free)
 {
-  unsigned long a, *pte;
+  unsigned long a, next, *pte;
+  struct ptcursor c = {0};
+  int stale = 0;
 
   if ((va % PGSIZE) != 0)
     panic("uvm_unmap: not aligned");
 
   for (a = va; a < va + npages*PGSIZE; a += PGSIZE) {
-    if ((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvm_unmap: walk");
+    if (!(pte = walk_cursor(pagetable, &c, a, 0, &next))) {
+      a = next - PGSIZE;
+      continue;
+    }
+    if (*pte == PTE_GUARD)
+      *pte = 0;
+    if ((*pte & PTE_V) == 0) {
+      if (*pte & PTE_SWAP) {
+        swap_free(PTE2SLOT(*pte));
+        *pte = 0;
+      }
+      continue;
+    }
 
-    if ((*pte & PTE_V) == 0)
-      panic("uvm_unmap: not mapped");
+    if (c.level == 1) {
+      if (!free)
+        panic("uvm_unmap: megapage");
+
+      if (a % PXSIZE(1) == 0 && va + npages*PGSIZE - a >= PXSIZE(1)) {
+        kfree_pages((void *)PTE2PA(*pte), HUGEORDER);
+        *pte = 0;
+        uvm_hugecount(pagetable, -1);
+        stale = 1;
+        a += PXSIZE(1) - PGSIZE;
+        continue;
+      }
+
+      /* The page at a is going away anyway: it becomes the table. */
+      uvm_split(pagetable, pte, (unsigned long *)LEAFPA(*pte, 1, a));
+      stale = 1;
+      continue;
+    }
 
     if (PTE_FLAGS(*pte) == PTE_V)
       panic("uvm_unmap: not a leaf");
@@ -155,7 +506,11 @@ void uvm_unmap(unsigned long * pagetable, unsigned long va, unsigned long npages
       kfree((void*)PTE2PA(*pte));
 
     *pte = 0;
+    stale = 1;
   }
+
+  if (stale)
+    uvm_flush(pagetable, va, npages);
 }
 
 /* Load the user initcode into address 0 of pagetable, for the very first process. */
@@ -217,96 +572,637 @@ unsigned long uvm_dealloc(unsigned long * pagetable, unsigned long oldsz, unsign
   return newsz;
 }
 
-/* Recursively free page-table pages. */
-static void freewalk(unsigned long * pagetable)
+/* Recursively free page-table pages, and the user pages they still map,
+ * in memory or in swap. Otherwise only valid entries are visited: each
+ * page-table page keeps nothing but its own memory, so the page itself
+ * is freed without being cleared.
+ */
+static void freewalk(unsigned long * pagetable, int level)
 {
   unsigned long pte;
 
   /* There are 2^9 = 512 PTEs per page table. */
   for (int i = 0; i < 512; i++) {
-    pte = pagetable[i];
-    if ((pte & PTE_V) && !(pte & (PTE_R|PTE_W|PTE_X))) {
+    if (!((pte = pagetable[i]) & PTE_V)) {
+      if (pte & PTE_SWAP)
+        swap_free(PTE2SLOT(pte));
+      continue;
+    }
+
+    if (level > 0 && !(pte & (PTE_R|PTE_W|PTE_X))) {
       /* This PTE points to a lower-level page table. */
-      freewalk((unsigned long *)PTE2PA(pte));
-      pagetable[i] = 0;
-    } else if (pte & PTE_V) {
-      panic("freewalk: leaf");
+      freewalk((unsigned long *)PTE2PA(pte), level - 1);
+    } else {
+      /* A user page; the trampoline and trapframe are unmapped by now. */
+      kfree_pages((void*)PTE2PA(pte), level ? HUGEORDER : 0);
     }
   }
 
   kfree((void*)pagetable);
 }
 
-/* Free user memory pages, then free page-table pages. */
-void uvm_free(unsigned long * pagetable, unsigned long sz)
+/* Free all user memory pages, wherever they are mapped (heap, exec
+ * segments, mmap() regions), then free page-table pages.
+ */
+void uvm_free(unsigned long * pagetable)
 {
-  if (sz > 0)
-    uvm_unmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
-
-  freewalk(pagetable);
+  freewalk(pagetable, 2);
 }
 
-/* Given a parent process's page table, copy its memory into a child's page table. */
+/* Given a parent process's page table, share its memory with a child's page table.
+ * Writable pages become read-only copy-on-write in both tables; uvm_cow()
+ * makes the private copy on the first store. Megapages are split into
+ * 4K pages first, so that a store copies 4K rather than 2M.
+ */
 int uvm_copy(unsigned long * old, unsigned long * new, unsigned long sz)
 {
-  unsigned long *pte, pa, i;
-  unsigned int flags;
-  char *mem;
+  return uvm_share(old, new, 0, sz, true);
+}
 
-  for (i = 0; i < sz; i += PGSIZE) {
-    if (!(pte = walk(old, i, 0)))
-      panic("uvm_copy: pte should exist");
+/* Map the pages of old in [start, end) at the same addresses in new.
+ * If cow is set, writable pages become copy-on-write in both tables;
+ * otherwise both tables really share them, as for MAP_SHARED. Pages in
+ * swap share their slot, and each table reads back a copy of its own.
+ */
+int uvm_share(unsigned long * old, unsigned long * new, unsigned long start, unsigned long end, bool cow)
+{
+  unsigned long *pte, *npte, *table, pa, i, next;
+  struct ptcursor oc = {0}, nc = {0};
+  int stale = 0;
+
+  for (i = start; i < end; i += PGSIZE) {
+    /* Pages the parent never touched stay unmapped in the child too. */
+    if (!(pte = walk_cursor(old, &oc, i, 0, &next))) {
+      i = next - PGSIZE;
+      continue;
+    }
+    if (*pte == PTE_GUARD) {
+      /* The child's stack keeps its guard page. */
+      if (!(npte = walk_cursor(new, &nc, i, 1, 0)))
+        goto err;
+      *npte = PTE_GUARD;
+      continue;
+    }
+    if (!(*pte & PTE_V)) {
+      if (!(*pte & PTE_SWAP))
+        continue;
+      if (!(npte = walk_cursor(new, &nc, i, 1, 0)))
+        goto err;
+      *npte = *pte;
+      if (*npte & PTE_SWAPWP)
+        *npte = (*npte & ~PTE_SWAPWP) | PTE_COW;
+      swap_dup(PTE2SLOT(*pte));
+      continue;
+    }
+
+    if (oc.level == 1) {
+      if (!(table = kalloc()))
+        goto err;
+      uvm_split(old, pte, table);
+      pte = walk_cursor(old, &oc, i, 0, &next);
+    }
 
-    if (!(*pte & PTE_V))
-      panic("uvm_copy: page not present");
+    if (cow && (*pte & PTE_W)) {
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      stale = 1;
+    }
 
     pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if ((mem = kalloc()) == 0)
+    if (!(npte = walk_cursor(new, &nc, i, 1, 0)))
       goto err;
+    if (*npte & PTE_V)
+      panic("uvm_share: remap");
+
+    /* The child's regions are not registered with a uffd: its copy of a
+     * write-protected page is just copy-on-write. */
+    *npte = PA2PTE(pa) | PTE_FLAGS(*pte);
+    if (*pte & PTE_WP)
+      *npte = (*npte & ~PTE_WP) | PTE_COW;
+    kpage_ref((void *)pa);
+  }
+
+  /* The parent keeps running on its now read-only mappings. */
+  if (stale)
+    uvm_flush(old, start, (end - start) / PGSIZE);
+
+  return 0;
+
+ err:
+  if (stale)
+    uvm_flush(old, start, (i - start) / PGSIZE + 1);
+  uvm_unmap(new, start, (i - start) / PGSIZE, 1);
+  return -1;
+}
+
+#define SWAP_TRIES 8   /* Pages to swap out before giving up on an allocation */
+
+/* Allocate a page of user memory, zeroed if zero is set. If memory is
+ * exhausted, free cached program pages that no process maps, then swap
+ * other pages out to make room. Swapping sleeps, so a caller with
+ * interrupts off gets 0 once the cache is empty.
+ */
+void *uvm_page(bool zero)
+{
+  void *pa;
+
+  for (int i = 0; i < SWAP_TRIES; i++) {
+    if ((pa = zero ? kalloc() : kalloc_nozero()))
+      return pa;
+    /* Program pages nobody maps go before anything is swapped. */
+    if (itext_reclaim() > 0)
+      continue;
+    if (!intr_get() || swap_out() < 0)
+      break;
+  }
+
+  return 0;
+}
 
-    memmove(mem, (char*)pa, PGSIZE);
+/* Map the user page pa at va, swapping pages out if a page-table page
+ * cannot be allocated.
+ */
+int uvm_mappage(unsigned long * pagetable, unsigned long va, unsigned long pa, int perm)
+{
+  for (int i = 0; i < SWAP_TRIES; i++) {
+    if (mappages(pagetable, va, PGSIZE, pa, perm) == 0)
+      return 0;
+    if (!intr_get() || swap_out() < 0)
+      break;
+  }
+
+  return -1;
+}
+
+/* Resolve a store to a copy-on-write page at va. The last sharer simply
+ * gets its write permission back; everyone else gets a private copy.
+ * Returns 0 on success, -1 if va is not a copy-on-write page or memory
+ * is exhausted.
+ */
+static int uvm_cow(unsigned long * pagetable, unsigned long va)
+{
+  unsigned long *pte, pa;
+  char *mem;
+
+  if (va >= MAXVA)
+    return -1;
+
+  pte = walk(pagetable, PGROUNDDOWN(va), 0);
+  if (!pte || (*pte & (PTE_V | PTE_U | PTE_COW)) != (PTE_V | PTE_U | PTE_COW))
+    return -1;
+
+  pa = PTE2PA(*pte);
+  if (kpage_refcount((void *)pa) == 1) {
+    *pte = (*pte | PTE_W) & ~PTE_COW;
+  } else {
+    /* uvm_page() may sleep in swap_out(). Meanwhile our own reference
+     * keeps uvm_evict() off the page, even if the other sharers go, and
+     * only the process itself changes its PTEs otherwise. */
+    kpage_ref((void *)pa);
+    if (!(mem = uvm_page(pa == (unsigned long)zeropage))) {
+      kfree((void *)pa);
+      return -1;
+    }
+    if (pa != (unsigned long)zeropage)
+      memmove(mem, (char *)pa, PGSIZE);
+    *pte = PA2PTE(mem) | ((PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW);
+    kfree((void *)pa);
+    kfree((void *)pa);
+  }
+
+  /* A stale read-only entry would fault again. */
+  uvm_flush(pagetable, PGROUNDDOWN(va), 1);
+  return 0;
+}
+
+/* Map the zero page at va, for a read of anonymous memory with
+ * permissions perm. A writable page gets its own copy on the first store.
+ */
+int uvm_mapzero(unsigned long * pagetable, unsigned long va, int perm)
+{
+  if (perm & PTE_W)
+    perm = (perm & ~PTE_W) | PTE_COW;
+
+  kpage_ref(zeropage);
+  if (uvm_mappage(pagetable, va, (unsigned long)zeropage, perm | PTE_U)) {
+    kfree(zeropage);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Fill in the zero page field of a memstat snapshot. */
+void uvm_stats(struct memstat *ms)
+{
+  ms->zeromaps = kpage_refcount(zeropage) - 1;
+}
+
+/* Back the whole 2M region around heap address va with a megapage, if
+ * all of it is heap, none of it has been touched yet, and a free 2M
+ * block is to be had. Returns 0 if it did, -1 to fall back to 4K pages.
+ */
+static int uvm_huge(struct proc *p, unsigned long va)
+{
+  unsigned long base = va & ~(PXSIZE(1) - 1), *pte;
+  void *pa;
+
+  if (base + PXSIZE(1) > p->sz || vma_overlap(p, base, base + PXSIZE(1)))
+    return -1;
+
+  /* A level-0 table, even an empty one, means 4K pages were here. */
+  if (!(pte = walk_level(p->pagetable, base, 1, 1)) || *pte)
+    return -1;
+
+  if (!(pa = kalloc_pages(HUGEORDER)))
+    return -1;
 
-    if (mappages(new, i, PGSIZE, (unsigned long)mem, flags)) {
+  *pte = PA2PTE(pa) | PTE_R | PTE_W | PTE_U | PTE_V;
+  p->hugepages++;
+  return 0;
+}
+
+/* Write-protect the user pages of [start, end) for uffd_wp(), or lift
+ * the protection. A page that is shared gets PTE_COW back rather than
+ * PTE_W. A page in swap keeps the protection in its swap PTE until it
+ * is read back in. Only for the current process's own page table.
+ */
+void uvm_protect(unsigned long * pagetable, unsigned long start, unsigned long end, bool on)
+{
+  unsigned long va, next, *pte;
+  struct ptcursor c = {0};
+
+  for (va = start; va < end; va += PGSIZE) {
+    if (!(pte = walk_cursor(pagetable, &c, va, 0, &next))) {
+      va = next - PGSIZE;
+      continue;
+    }
+    if ((*pte & (PTE_V | PTE_SWAP)) == PTE_SWAP) {
+      /* Its own copy once it is read in, so copy-on-write is enough. */
+      if (on && (*pte & (PTE_W | PTE_COW)))
+        *pte = (*pte & ~(PTE_W | PTE_COW)) | PTE_SWAPWP;
+      else if (!on && (*pte & PTE_SWAPWP))
+        *pte = (*pte & ~PTE_SWAPWP) | PTE_COW;
+      continue;
+    }
+    if ((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+      continue;
+
+    if (on && (*pte & (PTE_W | PTE_COW)))
+      *pte = (*pte & ~(PTE_W | PTE_COW)) | PTE_WP;
+    else if (!on && (*pte & PTE_WP))
+      *pte = (*pte & ~PTE_WP) | (kpage_refcount((void *)PTE2PA(*pte)) == 1 ? PTE_W : PTE_COW);
+  }
+
+  uvm_flush(pagetable, start, (end - start) / PGSIZE);
+}
+
+/* Handle a page fault at va in process p's address space: a store to a
+ * copy-on-write page, a page in swap, the first touch of a demand-paged
+ * program segment, or the first touch of a heap page that sbrk() only
+ * reserved. Faults that a region registered with a uffd catches wait
+ * for its handler; a store to a page that uffd_wp() protected is one.
+ * Anonymous memory that is read first maps the zero page, and only a
+ * first store to the heap makes a megapage. A store resolves everything
+ * that stands in its way, so the page is writable on return. Returns 0
+ * if the access can be retried, -1 if it is invalid or memory is
+ * exhausted.
+ */
+int uvm_fault(struct proc *p, unsigned long va, bool write)
+{
+  unsigned long *pte;
+  struct vma *v;
+  char *mem;
+  int slot, r;
+
+  if (va >= MAXVA)
+    return -1;
+
+  va = PGROUNDDOWN(va);
+again:
+  pte = walk(p->pagetable, va, 0);
+  if (pte && *pte == PTE_GUARD)
+    return -1;
+  if (pte && (*pte & PTE_V) && write && (*pte & PTE_WP)) {
+    r = 1;
+    if ((v = vma_find(p, va)) && v->uffd && (v->uffdmode & UFFD_WP))
+      r = uffd_fault(p, v, va, UFFD_MSG_WRITE | UFFD_MSG_WP);
+    if (r < 0)
+      return -1;
+
+    /* Nobody is listening any more. */
+    if (r > 0)
+      uvm_protect(p->pagetable, va, va + PGSIZE, false);
+
+    /* Unprotected, a shared page is copy-on-write still. */
+    goto again;
+  }
+
+  if (pte && (*pte & PTE_V)) {
+    if (write && (*pte & (PTE_U | PTE_W)) == (PTE_U | PTE_W)) {
+      uvm_flush(p->pagetable, va, 1);
+      return 0;
+    }
+    if (!write || !(*pte & PTE_COW) || uvm_cow(p->pagetable, va) < 0)
+      return -1;
+
+    p->minflt++;
+    return 0;
+  }
+
+  if (pte && (*pte & PTE_SWAP)) {
+    /* Only p changes its own swap PTEs, so *pte holds still while we sleep. */
+    if (!(mem = uvm_page(false)))
+      return -1;
+
+    slot = PTE2SLOT(*pte);
+    swap_in(slot, mem);
+    *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~(PTE_SWAP | PTE_SWAPWP)) | PTE_V |
+           (*pte & PTE_SWAPWP ? PTE_WP : 0);
+    swap_free(slot);
+    p->majflt++;
+
+    /* A store may still find it copy-on-write or protected. */
+    if (write)
+      goto again;
+  } else if ((v = vma_find(p, va))) {
+    if ((write && !(v->perm & PTE_W)) || vma_fault(p, v, va, write) < 0)
+      return -1;
+  } else if (va < p->sz && write && uvm_huge(p, va) == 0) {
+    p->minflt++;
+    uvm_flush(p->pagetable, va & ~(PXSIZE(1) - 1), PXSIZE(1) / PGSIZE);
+    return 0;
+  } else if (va < p->sz && !write) {
+    if (uvm_mapzero(p->pagetable, va, PTE_R | PTE_W) < 0)
+      return -1;
+    p->minflt++;
+  } else {
+    if (va >= p->sz || !(mem = uvm_page(true)))
+      return -1;
+
+    if (uvm_mappage(p->pagetable, va, (unsigned long)mem, PTE_R | PTE_W | PTE_U)) {
       kfree(mem);
-      goto err;
+      return -1;
     }
+    p->minflt++;
   }
 
+  /* The TLB may hold on to the invalid entry. */
+  uvm_flush(p->pagetable, va, 1);
   return 0;
+}
 
- err:
-  uvm_unmap(new, 0, i / PGSIZE, 1);
-  return -1;
+#define EVICT_SCAN 1024  /* PTEs uvm_evict() looks at per call */
+
+/* Choose a page of p's to swap out to slot, by second chance: a page
+ * accessed since the last pass only loses its accessed bit. The chosen
+ * page's PTE becomes a swap PTE for slot. Only pages p alone maps
+ * qualify: not ones shared by fork(), the text cache or the zero page,
+ * nor MAP_SHARED ones, nor megapages, nor pages protected by uffd_wp().
+ * Called with p->lock held, p not running in user space.
+ * Returns the page, which the caller writes out and frees, or 0.
+ */
+void *uvm_evict(struct proc *p, int slot)
+{
+  unsigned long va = p->swapva, pa, next, *pte;
+  struct ptcursor c = {0};
+  struct vma *v;
+
+  for (int i = 0; i < EVICT_SCAN; i++, va += PGSIZE) {
+    if (va >= TRAPFRAME)
+      va = 0;
+    if (!(pte = walk_cursor(p->pagetable, &c, va, 0, &next))) {
+      va = next - PGSIZE;
+      continue;
+    }
+    if ((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+      continue;
+
+    /* Megapages stay in memory. */
+    if (c.level == 1) {
+      va = (va & ~(PXSIZE(1) - 1)) + PXSIZE(1) - PGSIZE;
+      continue;
+    }
+
+    pa = PTE2PA(*pte);
+    if ((*pte & PTE_WP) || kpage_refcount((void *)pa) != 1 || ((v = vma_find(p, va)) && (v->flags & MAP_SHARED)))
+      continue;
+
+    if (*pte & PTE_A)
+      *pte &= ~PTE_A;
+    else
+      *pte = SLOT2PTE(slot) | (PTE_FLAGS(*pte) & ~(PTE_V | PTE_D));
+
+    /* Either way the TLB must forget the old entry. */
+    if (p == myproc())
+      uvm_flush(p->pagetable, va, 1);
+    else
+      p->tlbdirty = 1;
+
+    if (*pte & PTE_SWAP) {
+      p->swapva = va + PGSIZE;
+      return (void *)pa;
+    }
+  }
+
+  p->swapva = va;
+  return 0;
 }
 
-/* Mark a PTE invalid for user access. */
+#define NUMA_SCAN 128  /* PTEs uvm_numa() looks at per call, a tick's worth */
+
+/* Count another window of p's resident pages by NUMA node, resuming
+ * where the last call stopped. The window is small, as this runs on
+ * every timer tick; a missing page table skips its whole range as one
+ * step. Once the scan has covered the whole
+ * address space, p's home node becomes the one holding most of them,
+ * and scheduler() favours harts on that node. The zero page is nobody's.
+ * Called by p itself, from a timer interrupt.
+ */
+void uvm_numa(struct proc *p)
+{
+  unsigned long va = p->numava, pa, next, *pte;
+  struct ptcursor c = {0};
+  int n, best;
+
+  for (int i = 0; i < NUMA_SCAN; i++, va += PGSIZE) {
+    if (va >= TRAPFRAME) {
+      for (best = p->node, n = 0; n < NNODE; n++)
+        if (p->numapages[n] > p->numapages[best])
+          best = n;
+      p->node = best;
+      memset(p->numapages, 0, sizeof(p->numapages));
+      va = 0;
+    }
+    if (!(pte = walk_cursor(p->pagetable, &c, va, 0, &next))) {
+      va = next - PGSIZE;
+      continue;
+    }
+    if ((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+      continue;
+
+    pa = PTE2PA(*pte);
+    if (c.level == 1) {
+      p->numapages[kpage_node((void *)pa)] += 1 << HUGEORDER;
+      va = (va & ~(PXSIZE(1) - 1)) + PXSIZE(1) - PGSIZE;
+    } else if ((void *)pa != zeropage) {
+      p->numapages[kpage_node((void *)pa)]++;
+    }
+  }
+
+  p->numava = va;
+}
+
+/* Return the PTE of a user page the kernel is about to copy to (write) or
+ * from, faulting it in first if it belongs to the current process, and
+ * marking it dirty for a copy to it.
+ * Consecutive pages of one copy share cursor c, so only the first page of
+ * each 2M region walks the whole tree; page-table pages are not freed
+ * while the process lives, even if the fault sleeps.
+ * Returns 0 if the page is not accessible.
+ */
+static unsigned long * uvm_pte(unsigned long * pagetable, struct ptcursor *c, unsigned long va, bool write)
+{
+  unsigned long need = PTE_V | PTE_U | (write ? PTE_W : 0), *pte, next;
+  struct proc *p = myproc();
+
+  if (va >= MAXVA)
+    return 0;
+
+  pte = walk_cursor(pagetable, c, va, 0, &next);
+  if (!pte || (*pte & need) != need) {
+    if (!p || p->pagetable != pagetable || uvm_fault(p, va, write) < 0)
+      return 0;
+
+    pte = walk_cursor(pagetable, c, va, 0, &next);
+    if (!pte || (*pte & need) != need)
+      return 0;
+  }
+
+  /* Stores through the direct map leave the dirty bit alone. */
+  if (write)
+    *pte |= PTE_A | PTE_D;
+
+  return pte;
+}
+
+/* Fault in the current process's pages of [va, va+len), for a copy to
+ * (write) or from them that will be made with an inode locked, when
+ * vma_fault() cannot read a file. Stops at the first page that cannot be
+ * faulted in; the copy itself then reports the error.
+ */
+void uvm_prefault(unsigned long va, unsigned long len, bool write)
+{
+  struct proc *p = myproc();
+  struct ptcursor c = {0};
+
+  for (unsigned long a = PGROUNDDOWN(va); a < va + len && a >= PGROUNDDOWN(va); a += PGSIZE)
+    if (!uvm_pte(p->pagetable, &c, a, write))
+      break;
+}
+
+#ifdef SUM
+/* With make SUM=1 the kernel loads and stores user memory directly, at
+ * UWINDOW plus the user address, instead of walking the page table and
+ * copying through the direct map. The window is the upper half of this
+ * hart's root: its top-level entries are those of the running process's
+ * user half, so it shares the lower page-table pages and sees every
+ * change to them. Its TLB entries belong to ASID 0, the kernel's.
+ *
+ * Point this hart's window at pagetable, or at nothing if it is 0.
+ * Called by the scheduler around each switch to a process, and by exec().
+ */
+void uvm_window(unsigned long * pagetable)
+{
+  unsigned long *w;
+
+  push_off();
+  w = mycpu()->kpagetable + 256;
+  if (pagetable) {
+    memmove(w, pagetable, PGSIZE / 2);
+    sfence_vma_asid(0);
+  } else {
+    /* Its page-table pages may be freed once the process is gone. */
+    memset(w, 0, PGSIZE / 2);
+  }
+  pop_off();
+}
+
+/* A load or store at va in the user window faulted in usercopy.S. Make
+ * the current process's page there accessible, as uvm_pte() does for a
+ * copy through the direct map. Returns 0 if the access can be retried,
+ * -1 if the copy fails.
+ */
+int uvm_window_fault(unsigned long va, bool write)
+{
+  struct proc *p = myproc();
+  struct ptcursor c = {0};
+  unsigned long *w;
+
+  if (!p || va < UWINDOW)
+    return -1;
+  va = PGROUNDDOWN(va - UWINDOW);
+
+  /* The process may have added a top-level entry since the switch. */
+  w = &mycpu()->kpagetable[256 + PX(2, va)];
+  if (*w != p->pagetable[PX(2, va)]) {
+    *w = p->pagetable[PX(2, va)];
+    sfence_vma_asid(0);
+  }
+
+  if (!uvm_pte(p->pagetable, &c, va, write))
+    return -1;
+
+  sfence_vma_page(UWINDOW + va, 0);
+  return 0;
+}
+
+/* Whether a copy of len bytes at va in pagetable can go through the
+ * user window: the current process's own memory, below the trapframe.
+ */
+static bool uvm_window_ok(unsigned long * pagetable, unsigned long va, unsigned long len)
+{
+  struct proc *p = myproc();
+
+  return p && p->pagetable == pagetable && va < TRAPFRAME && len <= TRAPFRAME - va;
+}
+#endif
+
+/* Turn the page at va into a guard page: free it and leave an invalid
+ * PTE_GUARD entry, which neither the user nor the kernel can access and
+ * which uvm_fault() will not fill in again. For a page table not in use.
+ */
 void uvm_clear(unsigned long * pagetable, unsigned long va)
 {
   unsigned long *pte = walk(pagetable, va, 0);
 
-  if (!pte)
+  if (!pte || !(*pte & PTE_V))
     panic("uvm_clear");
 
-  *pte &= ~PTE_U;
+  kfree((void *)PTE2PA(*pte));
+  *pte = PTE_GUARD;
 }
 
-/* Copy from kernel to user. */
+/* Copy from kernel to user. Breaks copy-on-write sharing of the destination pages. */
 int copy_to_user(unsigned long * pagetable, unsigned long dstva, char *src, unsigned long len)
 {
-  unsigned long n, va0, pa0;
+  unsigned long n, va0, *pte;
+  struct ptcursor c = {0};
+
+#ifdef SUM
+  if (uvm_window_ok(pagetable, dstva, len))
+    return user_copy((void *)(UWINDOW + dstva), src, len);
+#endif
 
   while (len > 0) {
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if (pa0 == 0)
+    if (!(pte = uvm_pte(pagetable, &c, va0, true)))
       return -1;
 
     n = PGSIZE - (dstva - va0);
     if (n > len)
       n = len;
 
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    memmove((void *)(LEAFPA(*pte, c.level, va0) + (dstva - va0)), src, n);
 
     len -= n, src += n, dstva = va0 + PGSIZE;
   }
@@ -317,19 +1213,24 @@ int copy_to_user(unsigned long * pagetable, unsigned long dstva, char *src, unsi
 /* Copy len bytes to dst from virtual address srcva in a given page table. */
 int copy_from_user(unsigned long * pagetable, char *dst, unsigned long srcva, unsigned long len)
 {
-  unsigned long n, va0, pa0;
+  unsigned long n, va0, *pte;
+  struct ptcursor c = {0};
+
+#ifdef SUM
+  if (uvm_window_ok(pagetable, srcva, len))
+    return user_copy(dst, (void *)(UWINDOW + srcva), len);
+#endif
 
   while (len > 0) {
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if (pa0 == 0)
+    if (!(pte = uvm_pte(pagetable, &c, va0, false)))
       return -1;
 
     n = PGSIZE - (srcva - va0);
     if (n > len)
       n = len;
 
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    memmove(dst, (void *)(LEAFPA(*pte, c.level, va0) + (srcva - va0)), n);
 
     len -= n, dst += n, srcva = va0 + PGSIZE;
   }
@@ -340,21 +1241,26 @@ int copy_from_user(unsigned long * pagetable, char *dst, unsigned long srcva, un
 /* Copy a null-terminated string from user to kernel. */
 int copyin_str(unsigned long * pagetable, char *dst, unsigned long srcva, unsigned long max)
 {
-  unsigned long n, va0, pa0;
+  unsigned long n, va0, *pte;
   int got_null = 0;
   char *p;
+  struct ptcursor c = {0};
+
+#ifdef SUM
+  if (uvm_window_ok(pagetable, srcva, 1))
+    return user_copystr(dst, (char *)(UWINDOW + srcva), max < TRAPFRAME - srcva ? max : TRAPFRAME - srcva);
+#endif
 
   while (got_null == 0 && max > 0) {
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if (pa0 == 0)
+    if (!(pte = uvm_pte(pagetable, &c, va0, false)))
       return -1;
 
     n = PGSIZE - (srcva - va0);
     if (n > max)
       n = max;
 
-    p = (char *) (pa0 + (srcva - va0));
+    p = (char *) (LEAFPA(*pte, c.level, va0) + (srcva - va0));
     while (n > 0) {
       if (*p == '\0') {
         *dst = '\0';
@@ -0,0 +1,535 @@
+/* Demand-paged regions of user address spaces. A region maps part of a
+ * file, or anonymous zeroed memory; its pages are filled in by
+ * vma_fault() the first time they are touched instead of when the
+ * region is created.
+ *
+ * Pages of read-only regions, such as program text, are cached per
+ * inode and shared by every process that maps them, so running a
+ * program again, or several copies of it, does not read or hold the
+ * same page twice. write() and truncation update the cached pages in
+ * place, so that every process mapping them sees the file as it is now.
+ * The cache is dropped when the file is freed or its inode table entry
+ * is reused. Pages no process maps any more are given back when user
+ * memory runs out (uvm_page()).
+ *
+ * Exec segments lie below p->sz. mmap() adds file and anonymous regions
+ * above the heap, placed downwards from the trapframe; munmap() frees
+ * their pages at once. A file region follows the file as it grows. A
+ * MAP_SHARED region maps the file's cached pages themselves, so every
+ * process that maps the file sees the others' stores and write()s at
+ * once. Its dirty pages are written back to the file when it is
+ * unmapped, at the latest on exec() or exit(); read() sees the stores
+ * from then on.
+ *
+ * shmat() regions map a shared memory segment (shm.c) the same way,
+ * as MAP_SHARED regions whose pages come from the segment.
+ *
+ * A private anonymous region may be registered with a uffd (uffd.c),
+ * which then gets to fill in its pages instead of vma_fault().
+ */
+
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "defs.h"
+#include "uffd.h"
+
+/* A cached read-only page: n bytes of the file at off, zero after that. */
+struct textpage {
+  struct textpage *next;
+  unsigned int off;
+  unsigned int n;
+  void *pa;
+};
+
+/* Protects every inode's text list, so that vma_text_reclaim() can trim
+ * them without the inode locks.
+ */
+static struct spinlock textlock;
+
+void vma_init()
+{
+  initlock(&textlock);
+}
+
+/* Returns the cached page holding n bytes of ip at off, reading it in
+ * if need be, with a reference taken for the caller. Bytes past the end
+ * of the file read as zero. Sets *hit if the page was already cached.
+ * Caller must hold ip->lock, so no one else adds the same page meanwhile.
+ */
+static void *vma_text(struct inode *ip, unsigned int off, unsigned int n, bool *hit)
+{
+  struct textpage *t;
+  unsigned int m;
+  void *mem;
+
+  acquire(&textlock);
+  for (t = ip->text; t; t = t->next) {
+    if (t->off == off && t->n == n) {
+      kpage_ref(t->pa);
+      release(&textlock);
+      *hit = true;
+      return t->pa;
+    }
+  }
+  release(&textlock);
+
+  *hit = false;
+  m = off >= ip->size ? 0 : ip->size - off < n ? ip->size - off : n;
+  if (!(t = kmalloc(sizeof(*t))))
+    return 0;
+  if (!(mem = uvm_page(true)) || readi(ip, 0, (unsigned long)mem, off, m) != m) {
+    if (mem)
+      kfree(mem);
+    kmfree(t);
+    return 0;
+  }
+
+  t->off = off;
+  t->n = n;
+  t->pa = mem;
+  kpage_ref(mem);
+  acquire(&textlock);
+  t->next = ip->text;
+  ip->text = t;
+  release(&textlock);
+
+  return mem;
+}
+
+/* Forget ip's cached pages. Processes that have them mapped keep them.
+ * Caller must hold ip->lock, or be the only one who can reach ip.
+ */
+void vma_text_drop(struct inode *ip)
+{
+  struct textpage *t;
+
+  acquire(&textlock);
+  while ((t = ip->text)) {
+    ip->text = t->next;
+    kfree(t->pa);
+    kmfree(t);
+  }
+  release(&textlock);
+}
+
+/* n bytes of ip at off were just written from src, or cut off by a
+ * truncation if src is 0. Bring the cached pages they fall in up to
+ * date in place, so that the processes that map them see the file as
+ * it is now. Caller must hold ip->lock.
+ */
+void vma_text_write(struct inode *ip, unsigned int off, char *src, unsigned int n)
+{
+  struct textpage *t;
+  unsigned int s, e;
+
+  acquire(&textlock);
+  for (t = ip->text; t; t = t->next) {
+    s = off > t->off ? off : t->off;
+    e = off + n < t->off + t->n ? off + n : t->off + t->n;
+    if (s >= e)
+      continue;
+    if (src)
+      memmove((char *)t->pa + (s - t->off), src + (s - off), e - s);
+    else
+      memset((char *)t->pa + (s - t->off), 0, e - s);
+  }
+  release(&textlock);
+}
+
+/* Free ip's cached pages that no process maps. Called by itext_reclaim()
+ * without ip->lock. Returns the number of pages freed.
+ */
+int vma_text_reclaim(struct inode *ip)
+{
+  struct textpage **tp, *t;
+  int n = 0;
+
+  acquire(&textlock);
+  for (tp = &ip->text; (t = *tp); ) {
+    if (kpage_refcount(t->pa) == 1) {
+      *tp = t->next;
+      kfree(t->pa);
+      kmfree(t);
+      n++;
+    } else {
+      tp = &t->next;
+    }
+  }
+  release(&textlock);
+
+  return n;
+}
+
+/* Find the region of p's address space that contains va, or 0 if none does. */
+struct vma *vma_find(struct proc *p, unsigned long va)
+{
+  struct vma *v;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++)
+    if (v->type != VMA_NONE && va >= v->start && va < PGROUNDUP(v->end))
+      return v;
+
+  return 0;
+}
+
+/* Map the page at va, filled from region v's file. A MAP_SHARED file
+ * region maps the file's own cached page, whole. A read of a private
+ * page past the end of the file maps the zero page. Returns 0 on
+ * success, -1 if the file could not be read or memory is exhausted.
+ */
+int vma_fault(struct proc *p, struct vma *v, unsigned long va, bool write)
+{
+  unsigned long off = PGROUNDDOWN(va) - v->start, left;
+  bool locked, hit = false, shared = v->type == VMA_FILE && (v->flags & MAP_SHARED);
+  unsigned int n = 0;
+  char *mem = 0;
+  int r;
+
+  if (v->uffd && (v->uffdmode & UFFD_MISSING) &&
+      (r = uffd_fault(p, v, va, write ? UFFD_MSG_WRITE : 0)) <= 0)
+    return r;
+
+  if (off < v->filesz) {
+    /* Reading sleeps, which a caller holding a spinlock cannot do. */
+    if (!intr_get())
+      return -1;
+
+    /* The fault may come from a copy out of this very file. Locking a
+     * second inode could deadlock against a process that holds it and
+     * faults on ours, so callers that copy with an inode locked fault
+     * the user pages in first (uvm_prefault()), and this never waits.
+     */
+    if (!(locked = holdingsleep(&v->ip->lock))) {
+      if (p->ilocks > 0)
+        return -1;
+      ilock(v->ip);
+    }
+    n = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+
+    /* An mmap() region sees as much of the file as there is now. */
+    if (v->type == VMA_FILE) {
+      left = v->ip->size > v->off + off ? v->ip->size - v->off - off : 0;
+      if (n > left)
+        n = left;
+    }
+    if (shared)
+      mem = vma_text(v->ip, v->off + off, PGSIZE, &hit);
+    else if (n > 0 && !(v->perm & PTE_W))
+      mem = vma_text(v->ip, v->off + off, n, &hit);
+    else if (n > 0 && (mem = uvm_page(true)) && readi(v->ip, 0, (unsigned long)mem, v->off + off, n) != n) {
+      kfree(mem);
+      mem = 0;
+    }
+    if (!locked)
+      iunlock(v->ip);
+    if (mem)
+      goto map;
+    if (n > 0 || shared)
+      return -1;
+  }
+
+  if (v->type == VMA_SHM) {
+    mem = shm_page(v->shm, (v->off + off) / PGSIZE);
+  } else if (!write && !(v->flags & MAP_SHARED)) {
+    if (uvm_mapzero(p->pagetable, PGROUNDDOWN(va), v->perm) < 0)
+      return -1;
+    p->minflt++;
+    return 0;
+  } else {
+    mem = uvm_page(true);
+  }
+
+  if (!mem)
+    return -1;
+
+ map:
+  if (uvm_mappage(p->pagetable, PGROUNDDOWN(va), (unsigned long)mem, v->perm | PTE_U)) {
+    kfree(mem);
+    return -1;
+  }
+
+  if (n && !hit)
+    p->majflt++;
+  else
+    p->minflt++;
+
+  return 0;
+}
+
+/* Returns a region of p overlapping [start, end), or 0 if none does. */
+struct vma *vma_overlap(struct proc *p, unsigned long start, unsigned long end)
+{
+  struct vma *v;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++)
+    if (v->type != VMA_NONE && start < PGROUNDUP(v->end) && v->start < end)
+      return v;
+
+  return 0;
+}
+
+/* Give a forked child the same regions as its parent. The parent's
+ * pages of exec segments come with the rest of its memory, but mmap()
+ * regions lie above p->sz and are mapped here. The child's regions are
+ * not registered with the parent's uffds. Returns -1, with nothing
+ * left mapped, if memory is exhausted.
+ */
+int vma_copy(struct proc *np, struct proc *p)
+{
+  struct vma *v;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->type == VMA_NONE || v->type == VMA_EXEC)
+      continue;
+
+    if (uvm_share(p->pagetable, np->pagetable, v->start, PGROUNDUP(v->end), !(v->flags & MAP_SHARED)) < 0) {
+      while (--v >= p->vma)
+        if (v->type != VMA_NONE && v->type != VMA_EXEC)
+          uvm_unmap(np->pagetable, v->start, (PGROUNDUP(v->end) - v->start) / PGSIZE, 1);
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < NVMA; i++) {
+    np->vma[i] = p->vma[i];
+    if (np->vma[i].ip)
+      idup(np->vma[i].ip);
+    if (np->vma[i].shm)
+      shm_dup(np->vma[i].shm);
+    np->vma[i].uffd = 0;
+    np->vma[i].uffdmode = 0;
+  }
+
+  return 0;
+}
+
+/* Drop every region in a table. Must be called inside a transaction,
+ * since it may put the last reference to a file.
+ */
+void vma_release(struct vma *vma)
+{
+  for (struct vma *v = vma; v < &vma[NVMA]; v++) {
+    if (v->ip)
+      iput(v->ip);
+    if (v->shm)
+      shm_put(v->shm);
+    if (v->uffd)
+      uffd_put(v->uffd);
+    v->ip = 0;
+    v->shm = 0;
+    v->uffd = 0;
+    v->type = VMA_NONE;
+  }
+}
+
+/* Choose where a new region of size bytes goes in p: at addr if that
+ * range lies above the heap and is free, or at the highest free range
+ * below the trapframe if addr is 0. Returns -1 if there is no room.
+ */
+static unsigned long vma_place(struct proc *p, unsigned long addr, unsigned long size)
+{
+  unsigned long end = TRAPFRAME;
+  struct vma *o;
+
+  if (addr) {
+    if (addr % PGSIZE != 0 || addr < PGROUNDUP(p->sz) || addr + size < addr ||
+        addr + size > TRAPFRAME || vma_overlap(p, addr, addr + size))
+      return -1;
+    return addr;
+  }
+
+  for (;;) {
+    if (end < size || end - size < PGROUNDUP(p->sz))
+      return -1;
+    if (!(o = vma_overlap(p, end - size, end)))
+      return end - size;
+    end = o->start;
+  }
+}
+
+/* Returns a free region slot of p, or 0 if there is none. */
+static struct vma *vma_slot(struct proc *p)
+{
+  struct vma *v;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++)
+    if (v->type == VMA_NONE)
+      return v;
+
+  return 0;
+}
+
+/* Map len bytes of ip from offset off into p's address space, or len
+ * bytes of zeroed memory if ip is 0, at addr if that range is free, or
+ * else at the highest free range below the trapframe. The file backs as
+ * much of the region as it reaches at each fault, so the region follows
+ * it as it grows. Returns the address, or -1 if there is no free region
+ * slot or address range.
+ */
+unsigned long vma_map(struct proc *p, struct inode *ip, unsigned long addr, unsigned long off, unsigned long len, int perm, int flags)
+{
+  unsigned long start = -1;
+  struct vma *v;
+
+  if (!(v = vma_slot(p)))
+    return -1;
+  if (addr)
+    start = vma_place(p, addr, PGROUNDUP(len));
+  if (start == -1 && (start = vma_place(p, 0, PGROUNDUP(len))) == -1)
+    return -1;
+
+  v->filesz = ip ? len : 0;
+  v->type = ip ? VMA_FILE : VMA_ANON;
+  v->start = start;
+  v->end = v->start + len;
+  v->perm = perm;
+  v->off = off;
+  v->flags = flags;
+  v->ip = ip ? idup(ip) : 0;
+  v->shm = 0;
+  v->uffd = 0;
+
+  return v->start;
+}
+
+/* Attach segment s, len bytes long, to p at addr, or wherever mmap()
+ * would put it if addr is 0. The region takes over the caller's
+ * reference to s. Returns the address, or -1 if there is no free region
+ * slot or the address range is taken.
+ */
+unsigned long vma_shm(struct proc *p, struct shm *s, unsigned long addr, unsigned long len)
+{
+  unsigned long start;
+  struct vma *v;
+
+  if (!(v = vma_slot(p)) || (start = vma_place(p, addr, len)) == -1)
+    return -1;
+
+  v->type = VMA_SHM;
+  v->start = start;
+  v->end = start + len;
+  v->perm = PTE_R | PTE_W;
+  v->off = 0;
+  v->filesz = 0;
+  v->flags = MAP_SHARED;
+  v->ip = 0;
+  v->shm = s;
+  v->uffd = 0;
+
+  return start;
+}
+
+/* Write the pages of shared region v in [start, end) that p dirtied,
+ * by its own stores or the kernel's, back to its file, one log
+ * transaction's worth at a time as filewrite() does. Stores past the end
+ * of the file do not extend it.
+ */
+static void vma_writeback(struct proc *p, struct vma *v, unsigned long start, unsigned long end)
+{
+  unsigned long va, off, *pte;
+  unsigned int m, max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+
+  if (v->type != VMA_FILE || !(v->flags & MAP_SHARED) || !(v->perm & PTE_W))
+    return;
+
+  for (va = start; va < end; va += PGSIZE) {
+    if (!(pte = walk(p->pagetable, va, 0)) || (*pte & (PTE_V|PTE_D)) != (PTE_V|PTE_D))
+      continue;
+
+    off = v->off + va - v->start;
+    for (unsigned int i = 0; i < PGSIZE; i += m) {
+      begin_op();
+      ilock(v->ip);
+      m = v->ip->size > off + i ? v->ip->size - off - i : 0;
+      if (m > PGSIZE - i)
+        m = PGSIZE - i;
+      if (m > max)
+        m = max;
+      if (m > 0)
+        writei(v->ip, 0, PTE2PA(*pte) + i, off + i, m);
+      iunlock(v->ip);
+      end_op();
+      if (m == 0)
+        break;
+    }
+  }
+}
+
+/* Remove the mmap() regions of p in [start, end), which must be page
+ * aligned, writing shared pages back first. A region may be cut at
+ * either end or split in two. Returns -1, leaving everything mapped,
+ * if a split needs a free region slot and there is none.
+ */
+int vma_unmap(struct proc *p, unsigned long start, unsigned long end)
+{
+  unsigned long s, e, cut;
+  struct vma *v, *w;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->type == VMA_NONE || v->type == VMA_EXEC || end <= v->start || PGROUNDUP(v->end) <= start)
+      continue;
+
+    s = start > v->start ? start : v->start;
+    e = end < PGROUNDUP(v->end) ? end : PGROUNDUP(v->end);
+
+    /* A hole in the middle leaves two regions. */
+    w = 0;
+    if (s > v->start && e < PGROUNDUP(v->end)) {
+      for (w = p->vma; w < &p->vma[NVMA] && w->type != VMA_NONE; w++)
+        ;
+      if (w == &p->vma[NVMA])
+        return -1;
+    }
+
+    vma_writeback(p, v, s, e);
+    uvm_unmap(p->pagetable, s, (e - s) / PGSIZE, 1);
+
+    if (w) {
+      *w = *v;
+      cut = e - v->start;
+      w->start = e;
+      w->off += cut;
+      w->filesz = v->filesz > cut ? v->filesz - cut : 0;
+      if (w->ip)
+        idup(w->ip);
+      if (w->shm)
+        shm_dup(w->shm);
+      if (w->uffd)
+        uffd_dup(w->uffd);
+    }
+
+    if (s == v->start && e == PGROUNDUP(v->end)) {
+      if (v->ip) {
+        begin_op();
+        iput(v->ip);
+        end_op();
+      }
+      if (v->shm)
+        shm_put(v->shm);
+      if (v->uffd)
+        uffd_put(v->uffd);
+      v->ip = 0;
+      v->shm = 0;
+      v->uffd = 0;
+      v->type = VMA_NONE;
+    } else if (s == v->start) {
+      cut = e - v->start;
+      v->start = e;
+      v->off += cut;
+      v->filesz = v->filesz > cut ? v->filesz - cut : 0;
+    } else {
+      v->end = s;
+      if (v->filesz > s - v->start)
+        v->filesz = s - v->start;
+    }
+  }
+
+  return 0;
+}
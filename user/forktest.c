@@ -1,10 +1,12 @@
 // Test that fork fails gracefully.
-// Tiny executable so that the limit can be filling the proc table.
+// Tiny executable so that the limit can be filling the proc table,
+// or, since proc structs are allocated as needed, running out of memory.
 
+#include "kernel/param.h"
 #include "kernel/stat.h"
 #include "user/user.h"
 
-#define N  1000
+#define N  (NPROC + 1)
 
 void
 print(const char *s)
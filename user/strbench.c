@@ -0,0 +1,39 @@
+#include "user/user.h"
+
+// Throughput of ulib's memory and string routines, in KB per tick.
+
+#define SZ   (64*1024)
+#define RUNS 200
+
+char a[SZ], b[SZ];
+
+char *names[] = { "memset", "memmove", "memcmp", "strlen", "strcpy", "strchr" };
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, start, ticks;
+
+  memset(a, 'x', SZ - 1);
+  memmove(b, a, SZ);
+
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    start = uptime();
+    for (j = 0; j < RUNS; j++) {
+      switch (i) {
+      case 0: memset(b, 'x', SZ - 1); break;
+      case 1: memmove(b, a, SZ); break;
+      case 2: memcmp(a, b, SZ); break;
+      case 3: strlen(a); break;
+      case 4: strcpy(b, a); break;
+      case 5: strchr(a, 'y'); break;
+      }
+    }
+    ticks = uptime() - start;
+    if (ticks == 0)
+      ticks = 1;
+    printf("%s: %d KB/tick\n", names[i], SZ / 1024 * RUNS / ticks);
+  }
+
+  exit(0);
+}
@@ -0,0 +1,49 @@
+#include "user/user.h"
+
+// Time null system calls and pipe round trips between two processes,
+// the paths that switch page tables on every trap.
+
+#define N 100000
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, pid, start, fds[2], sfds[2];
+  char c = 'x';
+
+  n = argc > 1 ? atoi(argv[1]) : N;
+
+  start = uptime();
+  for (i = 0; i < n; i++)
+    getpid();
+  printf("%d getpid calls: %d ticks\n", n, uptime() - start);
+
+  if (pipe(fds) < 0 || pipe(sfds) < 0) {
+    printf("syscallbench: pipe failed\n");
+    exit(1);
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    printf("syscallbench: fork failed\n");
+    exit(1);
+  }
+
+  if (pid == 0) {
+    for (i = 0; i < n / 10; i++) {
+      read(fds[0], &c, 1);
+      write(sfds[1], &c, 1);
+    }
+    exit(0);
+  }
+
+  start = uptime();
+  for (i = 0; i < n / 10; i++) {
+    write(fds[1], &c, 1);
+    read(sfds[0], &c, 1);
+  }
+  printf("%d pipe round trips: %d ticks\n", n / 10, uptime() - start);
+
+  wait(0);
+  exit(0);
+}
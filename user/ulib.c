@@ -2,6 +2,30 @@
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
+// The memory and string routines move a 64-bit word at a time once
+// their pointers are word aligned, and a byte at a time otherwise:
+// misaligned loads and stores may trap.
+
+typedef unsigned long __attribute__((may_alias)) word;
+
+#define WORD  sizeof(word)
+#define ONES  0x0101010101010101UL
+#define HIGHS 0x8080808080808080UL
+
+// Nonzero if some byte of w is zero.
+#define HASZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
+#define ALIGNED(p) ((unsigned long)(p) % WORD == 0)
+#define COALIGNED(p, q) ((unsigned long)(p) % WORD == (unsigned long)(q) % WORD)
+
+#ifdef RVV
+// vstring.S, for calls long enough to pay for setting up the vector unit.
+void *vmemset(void*, int, unsigned int);
+void *vmemcpy(void*, const void*, unsigned int);
+int vmemcmp(const void*, const void*, unsigned int);
+#define VECTOR_MIN 64
+#endif
+
 //
 // wrapper so that it's OK if main() does not call exit().
 //
@@ -13,12 +37,21 @@ _main()
   exit(0);
 }
 
+// Reading whole aligned words may run past the end of a string,
+// but never off its page.
 char*
 strcpy(char *s, const char *t)
 {
   char *os;
 
   os = s;
+  if (COALIGNED(s, t)) {
+    for (; !ALIGNED(t); s++, t++)
+      if ((*s = *t) == 0)
+        return os;
+    for (; !HASZERO(*(word *)t); s += WORD, t += WORD)
+      *(word *)s = *(word *)t;
+  }
   while ((*s++ = *t++) != 0)
     ;
   return os;
@@ -35,27 +68,54 @@ strcmp(const char *p, const char *q)
 unsigned int
 strlen(const char *s)
 {
-  int n;
+  const char *p = s;
 
-  for (n = 0; s[n]; n++)
+  for (; !ALIGNED(p); p++)
+    if (*p == 0)
+      return p - s;
+  for (; !HASZERO(*(word *)p); p += WORD)
     ;
-  return n;
+  while (*p)
+    p++;
+  return p - s;
 }
 
 void*
 memset(void *dst, int c, unsigned int n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for (i = 0; i < n; i++) {
-    cdst[i] = c;
+  word w;
+
+#ifdef RVV
+  if (n >= VECTOR_MIN)
+    return vmemset(dst, c, n);
+#endif
+  for (; n > 0 && !ALIGNED(cdst); n--)
+    *cdst++ = c;
+  if (n >= WORD) {
+    w = (unsigned char)c * ONES;
+    for (; n >= WORD; n -= WORD, cdst += WORD)
+      *(word *)cdst = w;
   }
+  while (n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
 char*
 strchr(const char *s, char c)
 {
+  word cc = (unsigned char)c * ONES;
+
+  for (; !ALIGNED(s); s++) {
+    if (*s == 0)
+      return 0;
+    if (*s == c)
+      return (char*)s;
+  }
+  // Stop at the word holding either c or the terminator.
+  for (; !HASZERO(*(word *)s) && !HASZERO(*(word *)s ^ cc); s += WORD)
+    ;
   for (; *s; s++)
     if (*s == c)
       return (char*)s;
@@ -114,11 +174,30 @@ memmove(void *vdst, const void *vsrc, int n)
   dst = vdst;
   src = vsrc;
   if (src > dst) {
+#ifdef RVV
+    // Each vector chunk is loaded before it is stored.
+    if (n >= VECTOR_MIN)
+      return vmemcpy(vdst, vsrc, n);
+#endif
+    if (COALIGNED(src, dst)) {
+      for (; n > 0 && !ALIGNED(dst); n--)
+        *dst++ = *src++;
+      for (; n >= (int)WORD; n -= WORD, dst += WORD, src += WORD)
+        *(word *)dst = *(word *)src;
+    }
     while (n-- > 0)
       *dst++ = *src++;
   } else {
     dst += n;
     src += n;
+    if (COALIGNED(src, dst)) {
+      for (; n > 0 && !ALIGNED(dst); n--)
+        *--dst = *--src;
+      for (; n >= (int)WORD; n -= WORD) {
+        dst -= WORD, src -= WORD;
+        *(word *)dst = *(word *)src;
+      }
+    }
     while (n-- > 0)
       *--dst = *--src;
   }
@@ -129,6 +208,19 @@ int
 memcmp(const void *s1, const void *s2, unsigned int n)
 {
   const char *p1 = s1, *p2 = s2;
+
+#ifdef RVV
+  if (n >= VECTOR_MIN)
+    return vmemcmp(s1, s2, n);
+#endif
+  if (COALIGNED(p1, p2)) {
+    for (; n > 0 && !ALIGNED(p1); n--, p1++, p2++)
+      if (*p1 != *p2)
+        return *p1 - *p2;
+    // Skip equal words; the byte loop finds the difference in the first unequal one.
+    for (; n >= WORD && *(word *)p1 == *(word *)p2; n -= WORD)
+      p1 += WORD, p2 += WORD;
+  }
   while (n-- > 0) {
     if (*p1 != *p2) {
       return *p1 - *p2;
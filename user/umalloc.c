@@ -1,9 +1,15 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/param.h"
+#include "kernel/fcntl.h"
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
+//
+// Blocks of MMAP_MIN bytes or more get an anonymous mapping of
+// their own instead, so that free() can give them back to the kernel,
+// or come from the heap like the rest when no mapping is left.
+#define MMAP_MIN (64*1024)
 
 typedef long Align;
 
@@ -19,6 +25,7 @@ typedef union header Header;
 
 static Header base;
 static Header *freep;
+static Header mapped;  // s.ptr of a block that has its own mapping
 
 void
 free(void *ap)
@@ -26,6 +33,10 @@ free(void *ap)
   Header *bp, *p;
 
   bp = (Header*)ap - 1;
+  if (bp->s.ptr == &mapped) {
+    munmap(bp, bp->s.size * sizeof(Header));
+    return;
+  }
   for (p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if (p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -66,6 +77,15 @@ malloc(unsigned int nbytes)
   unsigned int nunits;
 
   nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  if (nbytes >= MMAP_MIN) {
+    p = mmap(0, nunits * sizeof(Header), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED) {
+      p->s.ptr = &mapped;
+      p->s.size = nunits;
+      return (void*)(p + 1);
+    }
+    // Out of mappings (they are shared with exec and shm): use the heap.
+  }
   if ((prevp = freep) == 0) {
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
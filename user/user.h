@@ -1,4 +1,6 @@
 struct status;
+struct memstat;
+struct pstat;
 
 // system calls
 int fork();
@@ -24,6 +26,19 @@ int sleep(int);
 int uptime();
 int readcount();
 int alarm(int ticks, void (*handler)());
+int getpinfo(struct pstat*);
+int memstat(struct memstat*);
+void* mmap(void*, unsigned long, int, int, int, unsigned long);
+int munmap(void*, unsigned long);
+int shmget(int, unsigned long);
+void* shmat(int, void*);
+int shmdt(void*);
+int shmrm(int);
+int uffd(void);
+int uffd_register(int, void*, unsigned long, int);
+int uffd_copy(int, void*, void*, unsigned long);
+int uffd_zero(int, void*, unsigned long);
+int uffd_wp(int, void*, unsigned long, int);
 
 // ulib.c
 int stat(const char*, struct status*);
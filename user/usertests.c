@@ -6,6 +6,9 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/memstat.h"
+#include "kernel/pstat.h"
+#include "kernel/uffd.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -1953,12 +1956,12 @@ iref(char *s)
 }
 
 // test that fork fails gracefully
-// the forktest binary also does this, but it runs out of proc entries first.
-// inside the bigger usertests binary, we run out of memory first.
+// the forktest binary also does this. whichever runs out first, proc
+// slots or memory, fork must fail before N.
 void
 forktest(char *s)
 {
-  enum{ N = 1000 };
+  enum{ N = NPROC + 1 };
   int n, pid;
 
   for (n=0; n<N; n++) {
@@ -1975,7 +1978,7 @@ forktest(char *s)
   }
 
   if (n == N) {
-    printf("%s: fork claimed to work 1000 times!\n", s);
+    printf("%s: fork claimed to work %d times!\n", s, N);
     exit(1);
   }
 
@@ -2395,7 +2398,7 @@ void argptest(char *s)
 }
 
 // check that there's an invalid page beneath
-// the user stack, to catch stack overflow.
+// the largest user stack, to catch stack overflow.
 void
 stacktest(char *s)
 {
@@ -2405,7 +2408,9 @@ stacktest(char *s)
   pid = fork();
   if (pid == 0) {
     char *sp = (char *) r_sp();
-    sp -= PGSIZE;
+    // this test uses less than a page of stack, so the stack can
+    // grow by USERSTACK-1 pages, and below that is the guard.
+    sp -= USERSTACK*PGSIZE;
     // the *sp should cause a trap.
     printf("%s: stacktest: read below stack %p\n", s, *sp);
     exit(1);
@@ -2585,6 +2590,1032 @@ void readcountstest(char *s)
   exit(1);
 }
 
+// return the number of free physical pages, from memstat().
+unsigned long
+freepages(char *s)
+{
+  struct memstat ms;
+
+  if (memstat(&ms) < 0) {
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  return ms.freepages;
+}
+
+// fork a process that holds more than half of free memory, which
+// only fits if fork shares pages copy-on-write.
+void
+cowfork(char *s)
+{
+  unsigned long sz;
+  char *p;
+  int pid, xstatus;
+
+  sz = (freepages(s) / 3) * 2 * PGSIZE;
+  p = sbrk(sz);
+  if (p == (char*)-1) {
+    printf("%s: sbrk(%l) failed\n", s, sz);
+    exit(1);
+  }
+  for (unsigned long i = 0; i < sz; i += PGSIZE)
+    p[i] = i / PGSIZE;
+
+  for (int n = 0; n < 3; n++) {
+    pid = fork();
+    if (pid < 0) {
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if (pid == 0) {
+      // write a few pages, and check the parent's copy is untouched.
+      for (unsigned long i = 0; i < 16*PGSIZE; i += PGSIZE)
+        p[i] = 0xff;
+      exit(p[sz - PGSIZE] != (char)((sz - PGSIZE) / PGSIZE));
+    }
+    wait(&xstatus);
+    if (xstatus != 0)
+      exit(xstatus);
+  }
+
+  for (unsigned long i = 0; i < sz; i += PGSIZE) {
+    if (p[i] != (char)(i / PGSIZE)) {
+      printf("%s: parent memory changed at %p\n", s, p + i);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// return this process's minor page fault count from getpinfo().
+int
+minflt()
+{
+  static struct pstat ps;
+  int pid = getpid();
+
+  if (getpinfo(&ps) < 0)
+    return -1;
+  for (int i = 0; i < NPROC; i++)
+    if (ps.pid[i] == pid)
+      return ps.minflt[i];
+  return -1;
+}
+
+// sbrk() should only reserve address space; pages are allocated
+// and counted as minor faults when first touched.
+void
+lazysbrk(char *s)
+{
+  enum { SZ = 32*1024*1024 };
+  unsigned long free0, used;
+  int flt0, flt1;
+  char *a;
+
+  free0 = freepages(s);
+  a = sbrk(SZ);
+  if (a == (char*)-1) {
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  if ((used = free0 - freepages(s)) > 8) {
+    printf("%s: sbrk allocated %l pages\n", s, used);
+    exit(1);
+  }
+
+  flt0 = minflt();
+  for (int i = 0; i < 4; i++)
+    a[i * (SZ / 4)] = i;
+  flt1 = minflt();
+  if (flt0 < 0 || flt1 - flt0 < 4) {
+    printf("%s: expected 4 minor faults, got %d\n", s, flt1 - flt0);
+    exit(1);
+  }
+  if (a[SZ - 1] != 0 || a[SZ / 4] != 1) {
+    printf("%s: lazily allocated memory has wrong contents\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// reading untouched heap maps the shared zero page instead of
+// allocating; the first store gives a page of its own.
+void
+zeropage(char *s)
+{
+  enum { N = 64 };
+  struct memstat ms0, ms1, ms2;
+  char *a;
+  int sum = 0;
+
+  a = sbrk(N * PGSIZE);
+  if (a == (char*)-1) {
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  memstat(&ms0);
+  for (int i = 0; i < N; i++)
+    sum += a[i * PGSIZE];
+  memstat(&ms1);
+  if (sum != 0 || ms1.zeromaps - ms0.zeromaps < N - 1 || ms1.freepages + N / 2 < ms0.freepages) {
+    printf("%s: %l zero page mappings, %l pages used\n", s,
+           ms1.zeromaps - ms0.zeromaps, ms0.freepages - ms1.freepages);
+    exit(1);
+  }
+
+  a[PGSIZE] = 1;
+  memstat(&ms2);
+  if (a[PGSIZE] != 1 || a[0] != 0 || a[2*PGSIZE] != 0 || ms2.zeromaps != ms1.zeromaps - 1) {
+    printf("%s: store to the zero page went wrong\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// every page comes from some NUMA node's lists, and a process's home
+// node is one of the nodes the device tree describes. With more than
+// one node (make NUMA=1), pages come from the allocating hart's own
+// node while it has plenty, and a process that filled memory on one
+// node soon calls that node home; N pages outweigh those it shares
+// with its parent. Children run one after the other, so that some
+// land on each node.
+void
+numastat(char *s)
+{
+  enum { N = 1024, NCHILD = 4, MAXTICKS = 200 };
+  static struct pstat ps;
+  struct memstat ms0, ms1;
+  unsigned long allocs, remote, most;
+  int pid, xstatus, home, t0;
+  char *a;
+
+  for (int c = 0; c < NCHILD; c++) {
+    pid = fork();
+    if (pid < 0) {
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if (pid != 0) {
+      wait(&xstatus);
+      if (xstatus != 0)
+        exit(1);
+      continue;
+    }
+
+    memstat(&ms0);
+    a = sbrk(N * PGSIZE);
+    if (a == (char*)-1) {
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for (int i = 0; i < N; i++)
+      a[i * PGSIZE] = i;
+    memstat(&ms1);
+
+    if (ms1.nnode < 1 || ms1.nnode > NNODE) {
+      printf("%s: %l nodes\n", s, ms1.nnode);
+      exit(1);
+    }
+    allocs = remote = most = 0;
+    home = 0;
+    for (int n = 0; n < NNODE; n++) {
+      if (ms1.noderemote[n] > ms1.nodeallocs[n] || (n >= ms1.nnode && ms1.nodefree[n] != 0)) {
+        printf("%s: node %d counters wrong\n", s, n);
+        exit(1);
+      }
+      if (ms0.nodefree[n] < 4 * N)
+        home = -1;
+      allocs += ms1.nodeallocs[n] - ms0.nodeallocs[n];
+      remote += ms1.noderemote[n] - ms0.noderemote[n];
+      if (home >= 0 && ms1.nodeallocs[n] - ms0.nodeallocs[n] > most) {
+        most = ms1.nodeallocs[n] - ms0.nodeallocs[n];
+        home = n;
+      }
+    }
+    if (allocs < N / 2) {
+      printf("%s: %l pages allocated for %d\n", s, allocs, N);
+      exit(1);
+    }
+    // a node running low lends pages, and then nothing is certain.
+    if (ms1.nnode == 1 || home < 0)
+      exit(0);
+
+    if (remote > allocs / 4) {
+      printf("%s: %l of %l pages from another node\n", s, remote, allocs);
+      exit(1);
+    }
+
+    // wait, running, for the timer-driven scan to cover the heap.
+    pid = getpid();
+    for (t0 = uptime(); uptime() - t0 < MAXTICKS; ) {
+      if (getpinfo(&ps) < 0) {
+        printf("%s: getpinfo failed\n", s);
+        exit(1);
+      }
+      for (int i = 0; i < NPROC; i++)
+        if (ps.pid[i] == pid && ps.node[i] == home)
+          exit(0);
+    }
+    printf("%s: home node not %d after %d ticks\n", s, home, MAXTICKS);
+    exit(1);
+  }
+}
+
+// fill n pages of stack, one frame per page, and return a checksum.
+int
+stackfill(int n)
+{
+  volatile char buf[PGSIZE - 64];
+
+  for (int i = 0; i < sizeof(buf); i += 256)
+    buf[i] = n;
+  if (n == 0)
+    return 0;
+  return stackfill(n - 1) + buf[0] + buf[256];
+}
+
+// the stack grows on demand, up to USERSTACK pages.
+void
+stackgrow(char *s)
+{
+  enum { N = USERSTACK / 4 };
+  int flt0, flt1, sum;
+
+  flt0 = minflt();
+  sum = stackfill(N);
+  flt1 = minflt();
+  if (sum != N * (N + 1)) {
+    printf("%s: stack contents wrong\n", s);
+    exit(1);
+  }
+  if (flt0 < 0 || flt1 - flt0 < N / 2) {
+    printf("%s: %d faults for %d pages\n", s, flt1 - flt0, N);
+    exit(1);
+  }
+  exit(0);
+}
+
+// memory freed back to the kernel should merge into large
+// buddy blocks again, apart from what the per-cpu caches and
+// pre-zeroed pools keep.
+void
+buddymerge(char *s)
+{
+  // at most KCACHE_MAX cached and KZERO_MAX pre-zeroed pages per
+  // hart (kalloc.c), and a few page-table pages sbrk() keeps.
+  enum { SZ = 16*1024*1024, CACHED = (32 + 32) * NCPU, TABLES = 16 };
+  struct memstat ms0, ms1;
+  unsigned long n, top0, top1;
+  char *a;
+
+  memstat(&ms0);
+  n = 0;
+  for (int o = 0; o <= MAXORDER; o++)
+    n += ms0.freeblocks[o] << o;
+  if (n > ms0.freepages || ms0.frag > 1000) {
+    printf("%s: inconsistent memstat\n", s);
+    exit(1);
+  }
+
+  a = sbrk(SZ);
+  if (a == (char*)-1) {
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < SZ; i += PGSIZE)
+    a[i] = 1;
+  sbrk(-SZ);
+
+  memstat(&ms1);
+  if (ms1.freepages + TABLES < ms0.freepages) {
+    printf("%s: %l free pages before, %l after\n", s, ms0.freepages, ms1.freepages);
+    exit(1);
+  }
+  top0 = ms0.freeblocks[MAXORDER] << MAXORDER;
+  top1 = ms1.freeblocks[MAXORDER] << MAXORDER;
+  if (top1 + CACHED < top0) {
+    printf("%s: %l pages in %d-page blocks before, %l after\n", s,
+           top0, 1 << MAXORDER, top1);
+    exit(1);
+  }
+  exit(0);
+}
+
+// harts with nothing to run zero free pages ahead of time, and
+// kalloc() hands those out first: after a pause, fresh heap pages
+// should come from the pool and read as zero.
+void
+zeropool(char *s)
+{
+  enum { N = 16 };
+  struct memstat ms0, ms1;
+  char *a;
+
+  sleep(5);
+  memstat(&ms0);
+  if (ms0.zeropages == 0) {
+    printf("%s: no pre-zeroed pages after idling\n", s);
+    exit(1);
+  }
+
+  a = sbrk(N * PGSIZE);
+  if (a == (char*)-1) {
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < N * PGSIZE; i += 64) {
+    if (a[i] != 0) {
+      printf("%s: fresh page not zero at %d\n", s, i);
+      exit(1);
+    }
+  }
+
+  memstat(&ms1);
+  if (ms1.zerohits == ms0.zerohits) {
+    printf("%s: no allocation came from the pre-zeroed pool\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// pipes and their files come from kernel object caches, so
+// several open pipes should fit in fewer pages than pipes.
+void
+slabpipe(char *s)
+{
+  enum { N = 6 };
+  unsigned long free0, used;
+  int fds[N][2];
+
+  free0 = freepages(s);
+  for (int i = 0; i < N; i++) {
+    if (pipe(fds[i]) < 0) {
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+  }
+  if ((used = free0 - freepages(s)) >= N) {
+    printf("%s: %d pipes used %l pages\n", s, N, used);
+    exit(1);
+  }
+  for (int i = 0; i < N; i++) {
+    close(fds[i][0]);
+    close(fds[i][1]);
+  }
+  exit(0);
+}
+
+// copy program from to file to, replacing to's contents.
+static void
+copyprog(char *s, char *from, char *to)
+{
+  static char buf[BSIZE];
+  int in, out, n;
+
+  in = open(from, O_RDONLY);
+  out = open(to, O_CREATE|O_TRUNC|O_WRONLY);
+  if (in < 0 || out < 0) {
+    printf("%s: cannot copy %s to %s\n", s, from, to);
+    exit(1);
+  }
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    if (write(out, buf, n) != n) {
+      printf("%s: write %s failed\n", s, to);
+      exit(1);
+    }
+  }
+  close(in);
+  close(out);
+}
+
+// run program file with one argument and return its exit status.
+static int
+runprog(char *s, char *file, char *arg)
+{
+  char *args[] = { file, arg, 0 };
+  int pid, xstatus;
+
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    exec(file, args);
+    exit(-2);
+  }
+  wait(&xstatus);
+  return xstatus;
+}
+
+// text pages are cached per file after a program exits; rewriting
+// the file must update them, or the next exec runs the old program,
+// and a read-only mapping of the file sees the new bytes.
+void
+textcache(char *s)
+{
+  struct status st;
+  char *p;
+  int fd;
+
+  copyprog(s, "mkdir", "textprog");
+  if (runprog(s, "textprog", "textdir") != 0 || stat("textdir", &st) < 0) {
+    printf("%s: textprog did not run mkdir\n", s);
+    exit(1);
+  }
+  copyprog(s, "rm", "textprog");
+  runprog(s, "textprog", "textdir");
+  if (stat("textdir", &st) == 0) {
+    printf("%s: rewritten textprog still ran mkdir\n", s);
+    exit(1);
+  }
+
+  fd = open("textprog", O_RDWR);
+  if (fd < 0 || (p = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    printf("%s: mapping textprog failed\n", s);
+    exit(1);
+  }
+  if (p[1] != 'E' || write(fd, "xyz", 3) != 3 || memcmp(p, "xyz", 3) != 0) {
+    printf("%s: read-only mapping did not see the write\n", s);
+    exit(1);
+  }
+  munmap(p, PGSIZE);
+  close(fd);
+  unlink("textprog");
+  exit(0);
+}
+
+// map a file private and shared; shared stores must reach the file
+// on munmap() and be seen by a forked child.
+void
+mmapfile(char *s)
+{
+  enum { SZ = 2*PGSIZE + 100 };
+  static char buf[SZ];
+  int fd, pid, xstatus;
+  char *p, *q;
+
+  for (int i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 23;
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if (fd < 0 || write(fd, buf, SZ) != SZ) {
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED || memcmp(p, buf, SZ) != 0 || p[SZ] != 0) {
+    printf("%s: private mapping has wrong contents\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+
+  q = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (q == MAP_FAILED || q == p || q[0] != 'a') {
+    printf("%s: shared mapping failed\n", s);
+    exit(1);
+  }
+  q[PGSIZE] = 'Y';
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    q[1] = 'Z';
+    exit(q[PGSIZE] != 'Y');
+  }
+  wait(&xstatus);
+  if (xstatus != 0 || q[1] != 'Z') {
+    printf("%s: shared mapping not shared with child\n", s);
+    exit(1);
+  }
+  if (munmap(q, SZ) < 0 || munmap(p, SZ) < 0) {
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if (fd < 0 || read(fd, buf, SZ) != SZ) {
+    printf("%s: reread failed\n", s);
+    exit(1);
+  }
+  if (buf[0] != 'a' || buf[1] != 'Z' || buf[PGSIZE] != 'Y') {
+    printf("%s: shared stores did not reach the file\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+  exit(0);
+}
+
+// two separate MAP_SHARED mappings of a file share its pages, see
+// write()s that grow the file, and a read() into one reaches the
+// file. the first mapping goes where mmap() was asked to put it.
+void
+mmapshared(char *s)
+{
+  enum { SZ = PGSIZE + 100 };
+  static char buf[SZ + 100];
+  char *hint = (char *)0x50000000, *p, *q;
+  int fd, fd2, fds[2];
+
+  memset(buf, 'a', 100);
+  fd = open("mmapshared", O_CREATE|O_RDWR);
+  fd2 = open("mmapshared", O_RDWR);
+  if (fd < 0 || fd2 < 0 || write(fd, buf, 100) != 100) {
+    printf("%s: create mmapshared failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(hint, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd2, 0);
+  if (p != hint || q == MAP_FAILED || q == p) {
+    printf("%s: mmap returned %p and %p\n", s, p, q);
+    exit(1);
+  }
+  p[0] = 'X';
+  if (q[0] != 'X' || q[99] != 'a' || q[150] != 0) {
+    printf("%s: stores not shared\n", s);
+    exit(1);
+  }
+
+  // fd's offset is 100: this fills the rest of the first page,
+  // which both map already, and half of the second.
+  memset(buf, 'b', SZ);
+  if (write(fd, buf, SZ) != SZ || p[150] != 'b' || q[PGSIZE + 50] != 'b') {
+    printf("%s: mappings did not follow the write\n", s);
+    exit(1);
+  }
+
+  if (pipe(fds) < 0 || write(fds[1], "k", 1) != 1 || read(fds[0], q + PGSIZE + 10, 1) != 1) {
+    printf("%s: read into the mapping failed\n", s);
+    exit(1);
+  }
+  if (munmap(q, SZ) < 0 || munmap(p, SZ) < 0) {
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  close(fd);
+  close(fd2);
+
+  fd = open("mmapshared", O_RDONLY);
+  if (fd < 0 || read(fd, buf, SZ + 100) != SZ + 100) {
+    printf("%s: reread failed\n", s);
+    exit(1);
+  }
+  if (buf[0] != 'X' || buf[150] != 'b' || buf[PGSIZE + 10] != 'k') {
+    printf("%s: stores did not reach the file\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapshared");
+  exit(0);
+}
+
+// anonymous mappings: pages come and go with the mapping, a hole
+// punched with munmap() faults, and a freed large malloc() block
+// goes back to the kernel.
+void
+mmapanon(char *s)
+{
+  enum { SZ = 256*PGSIZE };
+  unsigned long free0, used;
+  int pid, xstatus;
+  char *p;
+
+  free0 = freepages(s);
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < SZ; i += PGSIZE) {
+    if (p[i] != 0) {
+      printf("%s: anonymous memory not zeroed\n", s);
+      exit(1);
+    }
+    p[i] = 1;
+  }
+  if ((used = free0 - freepages(s)) < SZ / PGSIZE) {
+    printf("%s: touching %d pages used only %l\n", s, SZ / PGSIZE, used);
+    exit(1);
+  }
+
+  if (munmap(p + PGSIZE, PGSIZE) < 0) {
+    printf("%s: munmap of a hole failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if (pid == 0) {
+    if (p[0] != 1 || p[2*PGSIZE] != 1)
+      exit(1);
+    p[PGSIZE] = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != -1) {
+    printf("%s: store into an unmapped hole did not fault\n", s);
+    exit(1);
+  }
+
+  munmap(p, PGSIZE);
+  munmap(p + 2*PGSIZE, SZ - 2*PGSIZE);
+  if ((used = free0 - freepages(s)) > 16) {
+    printf("%s: munmap kept %l pages\n", s, used);
+    exit(1);
+  }
+
+  p = malloc(SZ);
+  for (int i = 0; i < SZ; i += PGSIZE)
+    p[i] = 1;
+  free(p);
+  if ((used = free0 - freepages(s)) > 16) {
+    printf("%s: free() kept %l pages\n", s, used);
+    exit(1);
+  }
+  exit(0);
+}
+
+// a child process handles the first touches of a uffd-registered
+// region, and a store to a page its owner write-protected.
+void
+uffdtest(char *s)
+{
+  enum { N = 4 };
+  static char page[PGSIZE];
+  struct uffd_msg m;
+  int fd, pid, xstatus, fds[2];
+  char *p, *q;
+
+  p = mmap(0, (N+1)*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED || (fd = uffd()) < 0) {
+    printf("%s: mmap or uffd failed\n", s);
+    exit(1);
+  }
+  if (uffd_register(fd, p, (N+1)*PGSIZE, UFFD_MISSING|UFFD_WP) < 0) {
+    printf("%s: uffd_register failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if (pid == 0) {
+    // N missing pages, then one write-protect fault.
+    for (int i = 0; i < N + 1; i++) {
+      if (read(fd, &m, sizeof(m)) != sizeof(m))
+        exit(1);
+      if (m.flags & UFFD_MSG_WP) {
+        if (m.addr != (unsigned long)p || uffd_wp(fd, (void*)m.addr, PGSIZE, 0) < 0)
+          exit(1);
+        continue;
+      }
+      memset(page, (m.addr - (unsigned long)p) / PGSIZE + 1, PGSIZE);
+      if (uffd_copy(fd, (void*)m.addr, page, PGSIZE) < 0)
+        exit(1);
+    }
+    exit(0);
+  }
+
+  for (int i = 0; i < N; i++) {
+    if (p[i*PGSIZE] != i + 1 || p[i*PGSIZE + PGSIZE-1] != i + 1) {
+      printf("%s: page %d holds %d\n", s, i, p[i*PGSIZE]);
+      exit(1);
+    }
+  }
+  if (uffd_wp(fd, p, PGSIZE, 1) < 0) {
+    printf("%s: uffd_wp failed\n", s);
+    exit(1);
+  }
+  p[0] = 42;
+  wait(&xstatus);
+  if (xstatus != 0 || p[0] != 42 || p[1] != 1) {
+    printf("%s: handler failed, status %d\n", s, xstatus);
+    exit(1);
+  }
+
+  // with the descriptor closed, the last page is ordinary memory.
+  close(fd);
+  if (p[N*PGSIZE] != 0) {
+    printf("%s: page not zero after close\n", s);
+    exit(1);
+  }
+  munmap(p, (N+1)*PGSIZE);
+
+  // a handler resolving more pages ahead of time than the queue
+  // holds must still leave room for the owner's next fault.
+  enum { EARLY = 20 };
+  p = mmap(0, (EARLY+1)*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED || (fd = uffd()) < 0 || pipe(fds) < 0 ||
+      uffd_register(fd, p, (EARLY+1)*PGSIZE, UFFD_MISSING) < 0) {
+    printf("%s: setting up early resolutions failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if (pid == 0) {
+    memset(page, 7, PGSIZE);
+    for (int i = 0; i < EARLY; i++)
+      uffd_copy(fd, p + i*PGSIZE, page, PGSIZE);
+    write(fds[1], "x", 1);
+    if (read(fd, &m, sizeof(m)) != sizeof(m) || uffd_copy(fd, (void*)m.addr, page, PGSIZE) < 0)
+      exit(1);
+    exit(0);
+  }
+  if (read(fds[0], page, 1) != 1 || p[EARLY*PGSIZE] != 7 || p[0] != 7) {
+    printf("%s: fault after early resolutions failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if (xstatus != 0) {
+    printf("%s: early handler failed, status %d\n", s, xstatus);
+    exit(1);
+  }
+  close(fd);
+  close(fds[0]);
+  close(fds[1]);
+  munmap(p, (EARLY+1)*PGSIZE);
+
+  // a read() into a protected zero page, nobody listening, still
+  // has to give the page its own copy.
+  q = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (q == MAP_FAILED || q[0] != 0 || (fd = uffd()) < 0 || pipe(fds) < 0 ||
+      uffd_register(fd, q, PGSIZE, UFFD_WP) < 0 || uffd_wp(fd, q, PGSIZE, 1) < 0) {
+    printf("%s: setting up the protected zero page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if (write(fds[1], "x", 1) != 1 || read(fds[0], q, 1) != 1 || q[0] != 'x') {
+    printf("%s: read into a protected zero page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  munmap(q, PGSIZE);
+}
+
+// ulib's word-at-a-time (and vector) memory and string routines
+// must agree with plain byte loops for every size and alignment.
+static unsigned long strseed = 1;
+
+static int
+strrand(int n)
+{
+  strseed = strseed * 6364136223846793005UL + 1442695040888963407UL;
+  return (strseed >> 33) % n;
+}
+
+static int
+samesign(int x, int y)
+{
+  return (x < 0) == (y < 0) && (x == 0) == (y == 0);
+}
+
+void
+stringops(char *s)
+{
+  enum { N = 600, MAXLEN = 520 };
+  static char a[N], b[N], c[N];
+  int len, oa, ob, i, k, r, ref;
+  char *p, ch;
+
+  for (int iter = 0; iter < 3000; iter++) {
+    len = strrand(MAXLEN);
+    oa = strrand(16);
+    ob = strrand(16);
+    for (i = 0; i < N; i++)
+      a[i] = 1 + strrand(255);
+
+    // memset
+    memmove(b, a, N);
+    memmove(c, a, N);
+    ch = strrand(256);
+    memset(b + ob, ch, len);
+    for (i = 0; i < len; i++)
+      c[ob + i] = ch;
+    if (memcmp(b, c, N) != 0) {
+      printf("%s: memset(+%d, %d) wrong\n", s, ob, len);
+      exit(1);
+    }
+
+    // memmove, overlapping in either direction
+    memmove(b, a, N);
+    memmove(c, a, N);
+    memmove(b + ob, b + oa, len);
+    if (oa > ob) {
+      for (i = 0; i < len; i++)
+        c[ob + i] = c[oa + i];
+    } else {
+      for (i = len - 1; i >= 0; i--)
+        c[ob + i] = c[oa + i];
+    }
+    for (i = 0; i < N; i++) {
+      if (b[i] != c[i]) {
+        printf("%s: memmove(+%d, +%d, %d) wrong at %d\n", s, ob, oa, len, i);
+        exit(1);
+      }
+    }
+
+    // memcmp, with at most one differing byte
+    memmove(b + ob, a + oa, len);
+    if (len > 0 && strrand(2)) {
+      k = strrand(len);
+      b[ob + k] = a[oa + k] + 1 + strrand(254);
+    }
+    ref = 0;
+    for (i = 0; i < len && ref == 0; i++)
+      ref = a[oa + i] - b[ob + i];
+    r = memcmp(a + oa, b + ob, len);
+    if (!samesign(r, ref)) {
+      printf("%s: memcmp(+%d, +%d, %d) = %d, want sign of %d\n", s, oa, ob, len, r, ref);
+      exit(1);
+    }
+
+    // strlen, strchr and strcpy on a string of len nonzero bytes
+    a[oa + len] = 0;
+    if (strlen(a + oa) != len) {
+      printf("%s: strlen(+%d) = %d, want %d\n", s, oa, strlen(a + oa), len);
+      exit(1);
+    }
+    ch = strrand(2) && len > 0 ? a[oa + strrand(len)] : 0;
+    for (p = a + oa; *p && *p != ch; p++)
+      ;
+    if (*p == 0)
+      p = 0;  // like strchr, never finds the terminator
+    if (strchr(a + oa, ch) != p) {
+      printf("%s: strchr(+%d, %d) wrong\n", s, oa, ch);
+      exit(1);
+    }
+    memset(b, 0x55, N);
+    strcpy(b + ob, a + oa);
+    if (memcmp(b + ob, a + oa, len + 1) != 0 || (ob > 0 && b[ob - 1] != 0x55) ||
+        b[ob + len + 1] != 0x55) {
+      printf("%s: strcpy(+%d, +%d) of %d bytes wrong\n", s, ob, oa, len);
+      exit(1);
+    }
+  }
+}
+
+// return this process's 2M page count from getpinfo().
+int
+hugepages()
+{
+  static struct pstat ps;
+  int pid = getpid();
+
+  if (getpinfo(&ps) < 0)
+    return -1;
+  for (int i = 0; i < NPROC; i++)
+    if (ps.pid[i] == pid)
+      return ps.hugepages[i];
+  return -1;
+}
+
+// a large heap should be backed by 2M pages, which a partial
+// shrink and fork split back into 4K pages without losing data.
+void
+hugeheap(char *s)
+{
+  enum { SZ = 8*1024*1024, HUGE = 2*1024*1024 };
+  unsigned long i;
+  int n, pid, xstatus;
+  char *a, *p;
+
+  a = sbrk(0);
+  p = (char *)(((unsigned long)a + HUGE - 1) & ~(unsigned long)(HUGE - 1));
+  if (sbrk(p + SZ - a) == (char*)-1) {
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for (i = 0; i < SZ; i += PGSIZE)
+    p[i] = i / PGSIZE;
+  if ((n = hugepages()) != SZ / HUGE) {
+    printf("%s: %d huge pages, want %d\n", s, n, SZ / HUGE);
+    exit(1);
+  }
+
+  sbrk(-PGSIZE);
+  if ((n = hugepages()) != SZ / HUGE - 1) {
+    printf("%s: %d huge pages after shrink, want %d\n", s, n, SZ / HUGE - 1);
+    exit(1);
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    for (i = 0; i < SZ - PGSIZE; i += PGSIZE)
+      if (p[i] != (char)(i / PGSIZE))
+        exit(1);
+    p[0] = 0xff;
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0) {
+    printf("%s: child saw wrong contents\n", s);
+    exit(1);
+  }
+  if (p[0] != 0 || p[SZ - 2*PGSIZE] != (char)(SZ / PGSIZE - 2)) {
+    printf("%s: parent memory changed\n", s);
+    exit(1);
+  }
+  if ((n = hugepages()) != 0) {
+    printf("%s: %d huge pages after fork\n", s, n);
+    exit(1);
+  }
+  exit(0);
+}
+
+// processes that attach the same segment, at different addresses,
+// see each other's stores; the segment goes away with its last user,
+// or with shmrm() if it has none.
+void
+shmtest(char *s)
+{
+  enum { KEY = 1234, SZ = 16*PGSIZE };
+  char *a, *b, *want = (char *)0x40000000;
+  unsigned long free0, free1;
+  int id, pid, xstatus;
+
+  free0 = freepages(s);
+  if ((id = shmget(KEY, SZ)) < 0 || (a = shmat(id, 0)) == (char*)-1) {
+    printf("%s: shmget/shmat failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < SZ; i += PGSIZE)
+    a[i] = i / PGSIZE;
+
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    // the child inherits a, and attaches the segment again at want.
+    if (shmget(KEY, SZ) != id || (b = shmat(id, want)) != want)
+      exit(1);
+    for (int i = 0; i < SZ; i += PGSIZE) {
+      if (b[i] != (char)(i / PGSIZE))
+        exit(2);
+      b[i + 1] = 'c';
+    }
+    if (a[1] != 'c' || shmdt(b) < 0 || shmdt(a) < 0)
+      exit(3);
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0) {
+    printf("%s: child failed with %d\n", s, xstatus);
+    exit(1);
+  }
+  for (int i = 0; i < SZ; i += PGSIZE) {
+    if (a[i + 1] != 'c') {
+      printf("%s: child's store at %d not seen\n", s, i);
+      exit(1);
+    }
+  }
+  if (shmdt(a) < 0 || shmdt(a) == 0) {
+    printf("%s: shmdt wrong\n", s);
+    exit(1);
+  }
+
+  // the last detach freed the segment, so this is a fresh one.
+  if ((id = shmget(KEY, PGSIZE)) < 0 || (a = shmat(id, 0)) == (char*)-1 || a[0] != 0) {
+    printf("%s: segment not freed\n", s);
+    exit(1);
+  }
+
+  // removed while attached, it stays until the detach, but the key
+  // finds a new segment.
+  if (shmrm(id) < 0 || shmrm(id) == 0 || shmat(id, 0) != (char*)-1) {
+    printf("%s: shmrm of an attached segment wrong\n", s);
+    exit(1);
+  }
+  a[0] = 'a';
+  if (shmget(KEY, PGSIZE) == id || a[0] != 'a') {
+    printf("%s: removed segment still found\n", s);
+    exit(1);
+  }
+  shmdt(a);
+
+  // segments nobody attached would use up every slot without shmrm().
+  for (int i = 0; i < 2*NSHM; i++) {
+    if ((id = shmget(KEY, PGSIZE)) < 0 || shmrm(id) < 0) {
+      printf("%s: unattached segment %d not freed\n", s, i);
+      exit(1);
+    }
+  }
+
+  if ((free1 = freepages(s)) + 8 < free0) {
+    printf("%s: %l pages lost\n", s, free0 - free1);
+    exit(1);
+  }
+  exit(0);
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2643,6 +3674,7 @@ struct test {
   {bigargtest, "bigargtest"},
   {argptest, "argptest"},
   {stacktest, "stacktest"},
+  {stackgrow, "stackgrow"},
   {textwrite, "textwrite"},
   {pgbug, "pgbug" },
   {sbrkbugs, "sbrkbugs" },
@@ -2650,6 +3682,21 @@ struct test {
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
   {readcountstest, "readcountstest" },
+  {cowfork, "cowfork" },
+  {lazysbrk, "lazysbrk" },
+  {buddymerge, "buddymerge" },
+  {zeropool, "zeropool" },
+  {slabpipe, "slabpipe" },
+  {textcache, "textcache" },
+  {mmapfile, "mmapfile" },
+  {mmapshared, "mmapshared" },
+  {mmapanon, "mmapanon" },
+  {stringops, "stringops" },
+  {hugeheap, "hugeheap" },
+  {shmtest, "shmtest" },
+  {zeropage, "zeropage" },
+  {numastat, "numastat" },
+  {uffdtest, "uffdtest" },
 
   { 0, 0},
 };
@@ -2939,6 +3986,42 @@ outofinodes(char *s)
   }
 }
 
+// touch more memory than is free; the excess has to go out to
+// swap and come back intact.
+void
+swapout(char *s)
+{
+  struct memstat ms0, ms1;
+  unsigned long sz, i;
+  char *p;
+
+  memstat(&ms0);
+  sz = (ms0.freepages + 1024) * PGSIZE;
+  p = sbrk(sz);
+  if (p == (char*)-1) {
+    printf("%s: sbrk(%l) failed\n", s, sz);
+    exit(1);
+  }
+  for (i = 0; i < sz; i += PGSIZE) {
+    *(unsigned long *)(p + i) = i;
+    *(unsigned long *)(p + i + PGSIZE - 8) = ~i;
+  }
+  for (i = 0; i < sz; i += PGSIZE) {
+    if (*(unsigned long *)(p + i) != i || *(unsigned long *)(p + i + PGSIZE - 8) != ~i) {
+      printf("%s: wrong contents at %p\n", s, p + i);
+      exit(1);
+    }
+  }
+
+  memstat(&ms1);
+  if (ms1.pageouts - ms0.pageouts < 1024 || ms1.pageins == ms0.pageins) {
+    printf("%s: %l pageouts, %l pageins\n", s, ms1.pageouts - ms0.pageouts,
+           ms1.pageins - ms0.pageins);
+    exit(1);
+  }
+  exit(0);
+}
+
 struct test slowtests[] = {
   {bigdir, "bigdir"},
   {manywrites, "manywrites"},
@@ -2946,6 +4029,7 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swapout, "swapout"},
     
   { 0, 0},
 };
@@ -38,3 +38,16 @@ entry("sleep");
 entry("uptime");
 entry("readcount");
 entry("alarm");
+entry("getpinfo");
+entry("memstat");
+entry("mmap");
+entry("munmap");
+entry("shmget");
+entry("shmat");
+entry("shmdt");
+entry("shmrm");
+entry("uffd");
+entry("uffd_register");
+entry("uffd_copy");
+entry("uffd_zero");
+entry("uffd_wp");